@@ -1,9 +1,27 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE             // syscall(), for perf_event_open
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 // For testing
 #include <time.h>
 #include <math.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
 
 /* treap.c
  *
@@ -13,6 +31,36 @@
  * if the inputs are in ascending (worst-case) insertion order.
  *
  * written December 2019 (?) by Thomas Pinkava 
+ *
+ * Build flags:
+ *   TREAP_MALLOC_NODES   allocate every node with malloc/free instead of the
+ *                        treap's slab pool (the old behaviour, for A/B runs)
+ *   TREAP_LIBC_RAND      draw priorities from the global rand() instead of the
+ *                        treap's own generator (again for A/B runs)
+ *   TREAP_HASHED_PRIORITY  derive each priority from a hash of its treeKey
+ *                        instead of storing heapKey; shapes then depend only
+ *                        on the key set, and usurping finds do not promote
+ *   TREAP_SIZES          keep a subtree size in every node, enabling
+ *                        treapSelect and treapRank in O(log n)
+ *   TREAP_THREADSAFE     give each treap a reader-writer lock (and each pool
+ *                        a mutex); see "Locking" below
+ *   TREAP_VALUE_TYPE     give every node a value of this type (an inline
+ *                        payload, or a pointer to one), e.g.
+ *                        -DTREAP_VALUE_TYPE=uint64_t
+ *   TREAP_NO_PARENT      drop the parent pointer (a third of a node): insert
+ *                        and delete work top-down by split and join, and
+ *                        iteration keeps a stack. Rotations, treapNext/Prev
+ *                        and TREAP_SIZES need the pointer and go.
+ *
+ * The itreap_* functions are an index-based twin of the treap_* core (find,
+ * append, decouple, usurping find) for comparing node layouts. The ctreap_*
+ * functions are a variant whose readers never block, built on the persistent
+ * (path-copying, parent-free) ptreap_* functions, and the
+ * streap_* functions spread one key space over several treaps (shards).
+ * TREAP_DEFINE generates treaps over other key and value types. treapFreeze
+ * takes an immutable, cache-oblivious snapshot for read-mostly phases, and
+ * treapEytzingerBuild a BFS-ordered one with branchless lookups. The btreap_*
+ * functions are a treap of sorted key blocks searched with SIMD compares.
 */
 
 
@@ -21,25 +69,651 @@
 typedef struct treap_node {
 
     unsigned int treeKey;   // The node's formal order for searching
+#ifndef TREAP_HASHED_PRIORITY
     unsigned int heapKey;   // The node's pseudorandom priority for Treaping
                             // Max heap, larger values are closer to root
+#endif
 
+#ifdef TREAP_NO_PARENT
+    struct treap_node *L, *R;
+#else
     struct treap_node *L, *R, *P;    // The "Parent" is NULL if this is the Root Node
+#endif
+
+#ifdef TREAP_SIZES
+    unsigned int size;      // Nodes in the subtree rooted here, this one included
+#endif
+#ifdef TREAP_VALUE_TYPE
+    TREAP_VALUE_TYPE value; // Zeroed when the node is created
+#endif
 
 } treap_node_t;
 
+#ifdef TREAP_VALUE_TYPE
+#define TREAP_CLEAR_VALUE(node) memset(&((node)->value), 0, sizeof((node)->value))
+#else
+#define TREAP_CLEAR_VALUE(node) ((void)0)
+#endif
+
+#if defined(TREAP_NO_PARENT) && defined(TREAP_SIZES)
+#error "TREAP_SIZES keeps sizes up to date through parent pointers"
+#endif
+
+// Parent pointer upkeep, which compiles away with TREAP_NO_PARENT
+#ifdef TREAP_NO_PARENT
+#define TREAP_SET_PARENT(node, parent) ((void)(parent))
+#else
+#define TREAP_SET_PARENT(node, parent) ((node)->P = (parent))
+#endif
+
+// Released subtrees (the pool's free list, discards) are chained through P, or,
+// without one, through the first eight bytes of the node, where its keys were.
+#ifdef TREAP_NO_PARENT
+_Static_assert(offsetof(treap_node_t, L) >= sizeof(treap_node_t *), "no room to chain released nodes");
+#endif
+
+static inline treap_node_t *treapChainNext(treap_node_t *node){
+#ifdef TREAP_NO_PARENT
+    treap_node_t *next;
+    memcpy(&next, node, sizeof(next));
+    return next;
+#else
+    return node->P;
+#endif
+}
+
+static inline void treapChainSet(treap_node_t *node, treap_node_t *next){
+#ifdef TREAP_NO_PARENT
+    memcpy(node, &next, sizeof(next));
+#else
+    node->P = next;
+#endif
+}
+
+
+// Priority of a key in hashed mode: the lowbias32 integer hash. It is a bijection,
+// so distinct keys never tie and the heap order (hence the shape) is unique.
+static inline unsigned int treapHashKey(unsigned int key){
+    uint32_t x = key;
+    x ^= x >> 16;
+    x *= 0x7FEB352DU;
+    x ^= x >> 15;
+    x *= 0x846CA68BU;
+    x ^= x >> 16;
+    return x;
+}
+
+// Every priority read goes through this, so it works on either node layout
+#ifdef TREAP_HASHED_PRIORITY
+#define TREAP_PRIORITY(node) treapHashKey((node).treeKey)
+#else
+#define TREAP_PRIORITY(node) ((node).heapKey)
+#endif
+
+// A hint to start loading the line at p, where the compiler offers one. It
+// never faults, so p may be NULL or past the end of an array.
+#ifdef __GNUC__
+#define TREAP_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define TREAP_PREFETCH(p) ((void)(p))
+#endif
+
+
+// Size maintenance: anything that changes a node's children calls treapUpdate on
+// it afterwards, bottom-up. Both compile away without TREAP_SIZES.
+#ifdef TREAP_SIZES
+#define TREAP_SIZE(node) (((node) == NULL) ? 0 : (node)->size)
+#endif
+
+static inline void treapUpdate(treap_node_t *node){
+#ifdef TREAP_SIZES
+    node->size = 1 + TREAP_SIZE(node->L) + TREAP_SIZE(node->R);
+#else
+    (void)node;
+#endif
+}
+
+// Updates node and every ancestor, after a change below node
+static inline void treapUpdatePath(treap_node_t *node){
+#ifdef TREAP_SIZES
+    while(node != NULL){
+        treapUpdate(node);
+        node = node->P;
+    }
+#else
+    (void)node;
+#endif
+}
+
+
+// Nodes are carved out of slabs owned by a pool. Released nodes go onto an
+// intrusive free list, so steady insert/delete churn never reaches the
+// general-purpose allocator. Slabs double in size up to a cap.
+//
+// The free list holds whole released subtrees, linked by treapChainSet; popping a root
+// pushes its children. Releasing a subtree of any size is therefore O(1), which
+// is what keeps treapEraseRange logarithmic.
+//
+// Each treap normally has a pool to itself, created on its first insert. Treaps
+// that exchange nodes (the outputs of treapSplit, say) share one pool, which is
+// freed along with the last of them.
+#define TREAP_SLAB_MIN 64
+#define TREAP_SLAB_MAX 65536
+
+typedef struct treap_slab {
+    struct treap_slab *next;
+    size_t count;
+    treap_node_t nodes[];
+} treap_slab_t;
+
+typedef struct treap_pool {
+    treap_slab_t *slabs;        // Every slab ever allocated, newest first
+    treap_node_t *freeList;     // Released subtrees, linked through P
+    size_t used;                // Nodes handed out from the newest slab so far
+    size_t nextSlab;            // Node count for the next slab allocation
+    unsigned int refs;          // Treaps drawing on this pool
+#ifdef TREAP_THREADSAFE
+    pthread_mutex_t lock;       // Treaps sharing a pool may be locked separately
+#endif
+} treap_pool_t;
+
+#ifdef TREAP_THREADSAFE
+#define TREAP_POOL_LOCK(pool) pthread_mutex_lock(&((pool)->lock))
+#define TREAP_POOL_UNLOCK(pool) pthread_mutex_unlock(&((pool)->lock))
+#else
+#define TREAP_POOL_LOCK(pool) ((void)0)
+#define TREAP_POOL_UNLOCK(pool) ((void)0)
+#endif
+
+
+// Nodes retired during one epoch (see "Epoch-based reclamation"), linked through
+// L with R cleared: a bucket is then itself a detached subtree that the pool
+// takes back in one go.
+typedef struct treap_limbo {
+    treap_node_t *nodes;
+    uint64_t epoch;
+} treap_limbo_t;
 
 // Having the treap be its own struct saves weirdness with backpointers
 typedef struct treap {
 
     treap_node_t* root;
-    // TODO: lock here for threadsafing; hand-over-hand would require four locks and would
-    //       be hell on toast for deadlocking concerns
+    treap_pool_t *pool;         // NULL until the first node is needed
+    uint64_t rng;               // Priority generator state, never zero
+    treap_limbo_t limbo[3];     // Retired nodes, by epoch modulo 3
+    unsigned int retiredSinceAdvance;
+#ifdef TREAP_THREADSAFE
+    // One lock for the whole treap: hand-over-hand would require four locks and would
+    // be hell on toast for deadlocking concerns
+    pthread_rwlock_t lock;
+#endif
 
 } treap_t;
 
 
+// Locking: with TREAP_THREADSAFE, treapFind takes the treap's lock shared, and
+// treapAppend and treapDecouple take it exclusive. treapUsurpingFind only
+// promotes when it can get the lock exclusively without waiting; otherwise it
+// falls back to a shared-lock find, so readers never queue behind it.
+// Everything else (split, join, set operations, navigation, iteration) expects
+// the caller to hold the lock, via treapLockShared/treapLockExclusive, and
+// compound operations such as find-then-decouple should do the same with the
+// *Unlocked forms. A node found under a shared lock may be decoupled by another
+// thread as soon as the lock drops; to go on reading its key afterwards, find it
+// inside treapEpochEnter/treapEpochExit and have writers treapRetire removed
+// nodes instead of releasing them.
+#ifdef TREAP_THREADSAFE
+#define TREAP_READ_LOCK(treap) pthread_rwlock_rdlock(&((treap)->lock))
+#define TREAP_WRITE_LOCK(treap) pthread_rwlock_wrlock(&((treap)->lock))
+#define TREAP_UNLOCK(treap) pthread_rwlock_unlock(&((treap)->lock))
+#else
+#define TREAP_READ_LOCK(treap) ((void)0)
+#define TREAP_WRITE_LOCK(treap) ((void)0)
+#define TREAP_UNLOCK(treap) ((void)0)
+#endif
+
+void treapLockShared(treap_t *treap){
+    (void)treap;
+    TREAP_READ_LOCK(treap);
+}
+
+void treapLockExclusive(treap_t *treap){
+    (void)treap;
+    TREAP_WRITE_LOCK(treap);
+}
+
+void treapUnlock(treap_t *treap){
+    (void)treap;
+    TREAP_UNLOCK(treap);
+}
+
+
+
+// Epoch-based reclamation: a node taken out of a structure that others read
+// concurrently is retired instead of freed, and only reused once no reader can
+// still hold it. Readers bracket their accesses with treapEpochEnter and
+// treapEpochExit, announcing the global epoch they started in. The epoch only
+// moves on once every reader inside a bracket has announced the current value,
+// so whatever was unlinked and then retired in epoch e is out of every reader's
+// reach by the time the epoch reaches e + 2. Each structure keeps its retired
+// nodes in three buckets by epoch and gives a bucket back whole, so a delete
+// never waits on readers. The epoch is process-wide, shared by treaps and
+// ctreaps alike; a reader stalled inside a bracket holds up reclamation (but
+// nothing else) everywhere.
+#define TREAP_EPOCH_SLOTS 128       // Most threads registered at once
+#define TREAP_EPOCH_BATCH 64        // Retirements between attempts to advance
+
+typedef struct treap_epoch_slot {
+    _Atomic uint64_t epoch;         // 2 * epoch + 1 inside a bracket, 0 outside
+    _Atomic int owned;
+    char pad[64 - sizeof(uint64_t) - sizeof(int)];  // One slot per cache line
+} treap_epoch_slot_t;
+
+static _Atomic uint64_t treapEpochGlobal = 1;
+static treap_epoch_slot_t treapEpochSlots[TREAP_EPOCH_SLOTS];
+static pthread_once_t treapEpochOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t treapEpochKey;     // Hands the slot back when its thread exits
+static _Thread_local treap_epoch_slot_t *treapEpochSlot;
+static _Thread_local unsigned int treapEpochDepth;
+
+static void treapEpochThreadExit(void *arg){
+    treap_epoch_slot_t *slot = (treap_epoch_slot_t *)arg;
+    atomic_store(&(slot->epoch), 0);
+    atomic_store(&(slot->owned), 0);
+}
+
+static void treapEpochKeyCreate(void){
+    pthread_key_create(&treapEpochKey, treapEpochThreadExit);
+}
+
+static treap_epoch_slot_t *treapEpochRegister(void){
+    pthread_once(&treapEpochOnce, treapEpochKeyCreate);
+    for(int i = 0; i < TREAP_EPOCH_SLOTS; i++){
+        int unowned = 0;
+        if(atomic_compare_exchange_strong(&(treapEpochSlots[i].owned), &unowned, 1)){
+            pthread_setspecific(treapEpochKey, &treapEpochSlots[i]);
+            return &treapEpochSlots[i];
+        }
+    }
+    fprintf(stderr, "treap: more than %d threads using epochs\n", TREAP_EPOCH_SLOTS);
+    exit(1);
+}
+
+// Brackets a read; nodes seen in between are not reused until after the
+// matching exit. Brackets nest, and both ends are wait-free.
+void treapEpochEnter(void){
+    if(treapEpochDepth++ > 0) return;
+    if(treapEpochSlot == NULL) treapEpochSlot = treapEpochRegister();
+    atomic_store(&(treapEpochSlot->epoch), 2 * atomic_load(&treapEpochGlobal) + 1);
+    // The announcement must be visible before any node is read
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+void treapEpochExit(void){
+    if(--treapEpochDepth > 0) return;
+    atomic_store_explicit(&(treapEpochSlot->epoch), 0, memory_order_release);
+}
+
+// Moves the global epoch on if every reader in a bracket has seen it, and
+// returns the epoch now current
+static uint64_t treapEpochAdvance(void){
+    uint64_t epoch = atomic_load(&treapEpochGlobal);
+    for(int i = 0; i < TREAP_EPOCH_SLOTS; i++){
+        uint64_t seen = atomic_load(&(treapEpochSlots[i].epoch));
+        if(seen != 0 && seen != 2 * epoch + 1) return epoch;
+    }
+    atomic_compare_exchange_strong(&treapEpochGlobal, &epoch, epoch + 1);
+    return atomic_load(&treapEpochGlobal);
+}
+
+
+
+// Priorities come from a per-treap xorshift64* generator rather than rand(),
+// which takes a process-wide lock in glibc and only yields 31 bits.
+static inline unsigned int treapRandom(uint64_t *state){
+#ifdef TREAP_LIBC_RAND
+    (void)state;
+    return (unsigned int)rand();
+#else
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return (unsigned int)((x * 0x2545F4914F6CDD1DULL) >> 32);
+#endif
+}
+
+// Scrambles a seed (splitmix64 finaliser) so that small or similar seeds still
+// give unrelated, non-zero generator states.
+static uint64_t treapSeedState(uint64_t seed){
+    uint64_t z = seed + 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+    return (z == 0) ? 0x9E3779B97F4A7C15ULL : z;
+}
+
+
+// Prepares an empty treap; must be called before any other operation on it.
+// The priority generator is seeded from rand(), so srand() still governs runs;
+// use treapSeed afterwards for a reproducible shape.
+void treapInit(treap_t *treap){
+    treap->root = NULL;
+    treap->pool = NULL;
+    treap->rng = treapSeedState(((uint64_t)rand() << 32) ^ (uint64_t)(uintptr_t)treap);
+    for(int i = 0; i < 3; i++){
+        treap->limbo[i].nodes = NULL;
+        treap->limbo[i].epoch = 0;
+    }
+    treap->retiredSinceAdvance = 0;
+#ifdef TREAP_THREADSAFE
+    pthread_rwlock_init(&(treap->lock), NULL);
+#endif
+}
+
+// Registers one more treap as a user of pool
+static void treapPoolRef(treap_pool_t *pool){
+    if(pool == NULL) return;
+    TREAP_POOL_LOCK(pool);
+    pool->refs++;
+    TREAP_POOL_UNLOCK(pool);
+}
+
+// Prepares an empty treap that allocates from the same pool as sibling, so that
+// nodes may move between the two (join, union and friends).
+void treapInitShared(treap_t *treap, treap_t *sibling){
+    treapInit(treap);
+    treap->pool = sibling->pool;
+    treapPoolRef(treap->pool);
+}
+
+// Fixes the priority sequence: the same seed and operations give the same treap.
+void treapSeed(treap_t *treap, uint64_t seed){
+    treap->rng = treapSeedState(seed);
+}
+
+
+#ifndef TREAP_MALLOC_NODES
+static treap_pool_t *treapPoolCreate(void){
+    treap_pool_t *pool = (treap_pool_t *)malloc(sizeof(treap_pool_t));
+    if(pool == NULL){
+        fprintf(stderr, "treap: out of memory\n");
+        exit(1);
+    }
+    pool->slabs = NULL;
+    pool->freeList = NULL;
+    pool->used = 0;
+    pool->nextSlab = TREAP_SLAB_MIN;
+    pool->refs = 1;
+#ifdef TREAP_THREADSAFE
+    pthread_mutex_init(&(pool->lock), NULL);
+#endif
+    return pool;
+}
+
+// Returns a subtree (or lone node) of the pool's nodes to its free list
+static void treapPoolRelease(treap_pool_t *pool, treap_node_t *node){
+    if(node == NULL) return;
+    treapChainSet(node, pool->freeList);
+    pool->freeList = node;
+}
+#endif
+
+
+// Hands out an uninitialised node, from the free list if possible, else from the
+// newest slab, else from a freshly allocated slab.
+static treap_node_t *treapNodeAlloc(treap_t *treap){
+#ifdef TREAP_MALLOC_NODES
+    (void)treap;
+    return (treap_node_t *)malloc(sizeof(treap_node_t));
+#else
+    if(treap->pool == NULL) treap->pool = treapPoolCreate();
+    treap_pool_t *pool = treap->pool;
+    TREAP_POOL_LOCK(pool);
+    treap_node_t *node = pool->freeList;
+    if(node != NULL){
+        pool->freeList = treapChainNext(node);
+        treapPoolRelease(pool, node->L);
+        treapPoolRelease(pool, node->R);
+        TREAP_POOL_UNLOCK(pool);
+        return node;
+    }
+    if(pool->slabs == NULL || pool->used == pool->slabs->count){
+        size_t count = pool->nextSlab;
+        treap_slab_t *slab = (treap_slab_t *)malloc(sizeof(treap_slab_t) + count * sizeof(treap_node_t));
+        if(slab == NULL){
+            fprintf(stderr, "treap: out of memory\n");
+            exit(1);
+        }
+        slab->count = count;
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+        pool->used = 0;
+        if(count < TREAP_SLAB_MAX) pool->nextSlab = count * 2;
+    }
+    node = &(pool->slabs->nodes[pool->used++]);
+    TREAP_POOL_UNLOCK(pool);
+    return node;
+#endif
+}
+
+
+// Hands out count nodes in one contiguous run, for bulk builds. The run gets a
+// slab of its own, slotted in behind the newest so that slab's carving goes on.
+static treap_node_t *treapNodeAllocBlock(treap_t *treap, size_t count){
+#ifdef TREAP_MALLOC_NODES
+    // Nodes are freed one by one in this mode, so they cannot share a block
+    (void)treap;
+    (void)count;
+    return NULL;
+#else
+    if(treap->pool == NULL) treap->pool = treapPoolCreate();
+    treap_pool_t *pool = treap->pool;
+    treap_slab_t *slab = (treap_slab_t *)malloc(sizeof(treap_slab_t) + count * sizeof(treap_node_t));
+    if(slab == NULL){
+        fprintf(stderr, "treap: out of memory\n");
+        exit(1);
+    }
+    slab->count = count;
+    TREAP_POOL_LOCK(pool);
+    if(pool->slabs == NULL){
+        slab->next = NULL;
+        pool->slabs = slab;
+        pool->used = count;
+    } else {
+        slab->next = pool->slabs->next;
+        pool->slabs->next = slab;
+    }
+    TREAP_POOL_UNLOCK(pool);
+    return slab->nodes;
+#endif
+}
+
+
+// Gives a node that has been decoupled from the treap back to the treap's pool.
+void treapRelease(treap_t *treap, treap_node_t *node){
+#ifdef TREAP_MALLOC_NODES
+    (void)treap;
+    free(node);
+#else
+    node->L = NULL;
+    node->R = NULL;
+    TREAP_POOL_LOCK(treap->pool);
+    treapPoolRelease(treap->pool, node);
+    TREAP_POOL_UNLOCK(treap->pool);
+#endif
+}
+
+
+// Gives back a whole detached subtree at once: O(1) with the slab pool.
+void treapReleaseTree(treap_t *treap, treap_node_t *root){
+#ifdef TREAP_MALLOC_NODES
+    (void)treap;
+    // Flatten with right-rotations so nodes can be freed without a stack
+    treap_node_t *cur = root;
+    while(cur != NULL){
+        if(cur->L != NULL){
+            treap_node_t *pivot = cur->L;
+            cur->L = pivot->R;
+            pivot->R = cur;
+            cur = pivot;
+        } else {
+            treap_node_t *next = cur->R;
+            free(cur);
+            cur = next;
+        }
+    }
+#else
+    if(root == NULL) return;
+    TREAP_POOL_LOCK(treap->pool);
+    treapPoolRelease(treap->pool, root);
+    TREAP_POOL_UNLOCK(treap->pool);
+#endif
+}
+
+
+// Drops one treap's claim on pool, freeing it with its slabs after the last
+static void treapPoolUnref(treap_pool_t *pool){
+    if(pool == NULL) return;
+    TREAP_POOL_LOCK(pool);
+    unsigned int refs = --(pool->refs);
+    TREAP_POOL_UNLOCK(pool);
+    if(refs == 0){
+        treap_slab_t *slab = pool->slabs;
+        while(slab != NULL){
+            treap_slab_t *next = slab->next;
+            free(slab);
+            slab = next;
+        }
+#ifdef TREAP_THREADSAFE
+        pthread_mutex_destroy(&(pool->lock));
+#endif
+        free(pool);
+    }
+}
+
+// Frees every node the treap ever allocated, leaving it empty (but still usable,
+// and with its generator state intact).
+// With a private pool this is O(number of slabs); outstanding decoupled nodes
+// that were never released die with it. With a shared pool the treap's nodes
+// go back to the pool for its other users, and the treap gets a fresh pool
+// next time it needs one. Retired nodes are reclaimed at once, so no reader may
+// still be using the treap.
+static void treapReset(treap_t *treap){
+    treapReleaseTree(treap, treap->root);
+    treap->root = NULL;
+    for(int i = 0; i < 3; i++){
+        treapReleaseTree(treap, treap->limbo[i].nodes);
+        treap->limbo[i].nodes = NULL;
+    }
+    treap_pool_t *pool = treap->pool;
+    treap->pool = NULL;
+    treapPoolUnref(pool);
+}
+
+// Tears the treap down for good: its nodes go as by treapReset above, and under
+// TREAP_THREADSAFE its lock is destroyed too. It must be initialised again
+// before any further use.
+void treapDestroy(treap_t *treap){
+    treapReset(treap);
+#ifdef TREAP_THREADSAFE
+    pthread_rwlock_destroy(&(treap->lock));
+#endif
+}
+
 
+#ifndef TREAP_MALLOC_NODES
+// Copies a subtree into the treap's own pool, returning the copy's root
+static treap_node_t *treapCopyNodes(treap_t *treap, treap_node_t *node, treap_node_t *parent){
+    if(node == NULL) return NULL;
+    treap_node_t *copy = treapNodeAlloc(treap);
+    *copy = *node;
+    TREAP_SET_PARENT(copy, parent);
+    copy->L = treapCopyNodes(treap, node->L, copy);
+    copy->R = treapCopyNodes(treap, node->R, copy);
+    return copy;
+}
+#endif
+
+// Makes src's nodes allocated from dst's pool, so that they may be linked into
+// dst. A pool that src alone uses is spliced into dst's pool in O(slabs + free
+// list); nodes in a pool shared with third parties are copied over instead, and
+// src's retired nodes reclaimed at once (as by treapReset) before src drops
+// its claim on that pool. src->root is updated to point at the (possibly
+// copied) nodes.
+static void treapAdoptPool(treap_t *dst, treap_t *src){
+#ifdef TREAP_MALLOC_NODES
+    (void)dst;
+    (void)src;
+#else
+    treap_pool_t *from = src->pool;
+    if(from == dst->pool || from == NULL) return;
+    if(dst->pool == NULL){
+        dst->pool = from;
+        treapPoolRef(from);
+        return;
+    }
+    treap_pool_t *to = dst->pool;
+    TREAP_POOL_LOCK(from);
+    unsigned int fromRefs = from->refs;
+    TREAP_POOL_UNLOCK(from);
+    if(fromRefs > 1){
+        treap_node_t *copy = treapCopyNodes(dst, src->root, NULL);
+        treapReleaseTree(src, src->root);
+        src->root = copy;
+        // src's retired nodes are from's too, so they go back there now rather
+        // than into to later; then src lets go of from
+        for(int i = 0; i < 3; i++){
+            treapReleaseTree(src, src->limbo[i].nodes);
+            src->limbo[i].nodes = NULL;
+        }
+        treapPoolUnref(from);
+    } else {
+        // from is src's alone, so only to needs locking
+        TREAP_POOL_LOCK(to);
+        // Unused tail of from's newest slab is handed out via the free list
+        if(from->slabs != NULL){
+            for(size_t i = from->used; i < from->slabs->count; i++){
+                treap_node_t *node = &(from->slabs->nodes[i]);
+                node->L = NULL;
+                node->R = NULL;
+                treapPoolRelease(to, node);
+            }
+        }
+        while(from->freeList != NULL){
+            treap_node_t *node = from->freeList;
+            from->freeList = treapChainNext(node);
+            treapPoolRelease(to, node);
+        }
+        // Slot the slabs in behind to's newest, which is still being carved up
+        treap_slab_t *slab = from->slabs;
+        while(slab != NULL){
+            treap_slab_t *next = slab->next;
+            if(to->slabs == NULL){
+                // to has no slab yet; treat the spliced ones as fully carved
+                slab->next = NULL;
+                to->slabs = slab;
+                to->used = slab->count;
+            } else {
+                slab->next = to->slabs->next;
+                to->slabs->next = slab;
+            }
+            slab = next;
+        }
+        TREAP_POOL_UNLOCK(to);
+#ifdef TREAP_THREADSAFE
+        pthread_mutex_destroy(&(from->lock));
+#endif
+        free(from);
+    }
+    src->pool = to;
+    treapPoolRef(to);
+#endif
+}
+
+
+#ifndef TREAP_NO_PARENT
 // Performs either a Left-Rotation or a Right-Rotation between the two nodes in the indicated treap,
 // based on their treeKey values. "Root" is one that is closer to root and will be moved further out;
 // "Pivot" is the child of "Root" that will take its place.
@@ -68,13 +742,17 @@ void treapRotate(treap_t *treap, treap_node_t* root, treap_node_t* pivot){
         root->P->R = pivot;
     }
     root->P = pivot;
+    // root is now pivot's child, so refresh it first
+    treapUpdate(root);
+    treapUpdate(pivot);
 }
+#endif
 
 
 
 
 // Does the bleeding obvious; returns NULL if unfound.
-treap_node_t *treapFind(treap_t *treap, unsigned int key){
+treap_node_t *treapFindUnlocked(treap_t *treap, unsigned int key){
     treap_node_t *cur = treap->root;
     while(cur != NULL){
         if(key < cur->treeKey){
@@ -88,13 +766,265 @@ treap_node_t *treapFind(treap_t *treap, unsigned int key){
     return NULL;
 }
 
+treap_node_t *treapFind(treap_t *treap, unsigned int key){
+    TREAP_READ_LOCK(treap);
+    treap_node_t *node = treapFindUnlocked(treap, key);
+    TREAP_UNLOCK(treap);
+    return node;
+}
+
+
+// Looks up n keys at once: out[i] = treapFind(treap, keys[i]). A lone find
+// waits on one cache miss per level; here up to TREAP_FIND_GROUP descents are
+// in flight, each taking one step and prefetching its next node before the
+// others take theirs, so their misses overlap (asynchronous memory access
+// chaining). A descent that finishes hands its place to the next key at once.
+#define TREAP_FIND_GROUP 32
+
+void treapFindManyUnlocked(treap_t *treap, const unsigned int *keys, size_t n, treap_node_t **out){
+    treap_node_t *cur[TREAP_FIND_GROUP];
+    size_t which[TREAP_FIND_GROUP];
+    size_t next = 0;
+    int active = 0;
+    for(; active < TREAP_FIND_GROUP && next < n; active++){
+        which[active] = next++;
+        cur[active] = treap->root;
+    }
+    while(active > 0){
+        for(int i = 0; i < active; ){
+            treap_node_t *node = cur[i];
+            unsigned int key = keys[which[i]];
+            if(node == NULL || node->treeKey == key){
+                out[which[i]] = node;
+                if(next < n){
+                    which[i] = next++;
+                    cur[i] = treap->root;
+                    i++;
+                } else {
+                    // Fill the hole from the end, and step that descent next
+                    active--;
+                    which[i] = which[active];
+                    cur[i] = cur[active];
+                }
+                continue;
+            }
+            node = (key < node->treeKey) ? node->L : node->R;
+            TREAP_PREFETCH(node);
+            cur[i] = node;
+            i++;
+        }
+    }
+}
+
+void treapFindMany(treap_t *treap, const unsigned int *keys, size_t n, treap_node_t **out){
+    TREAP_READ_LOCK(treap);
+    treapFindManyUnlocked(treap, keys, n, out);
+    TREAP_UNLOCK(treap);
+}
+
+
+// The first node with a key at or above key, or NULL if there is none.
+treap_node_t *treapLowerBound(treap_t *treap, unsigned int key){
+    treap_node_t *cur = treap->root, *best = NULL;
+    while(cur != NULL){
+        if(cur->treeKey < key){
+            cur = cur->R;
+        } else {
+            best = cur;
+            cur = cur->L;
+        }
+    }
+    return best;
+}
+
+// The first node with a key strictly above key, or NULL if there is none.
+treap_node_t *treapUpperBound(treap_t *treap, unsigned int key){
+    treap_node_t *cur = treap->root, *best = NULL;
+    while(cur != NULL){
+        if(cur->treeKey <= key){
+            cur = cur->R;
+        } else {
+            best = cur;
+            cur = cur->L;
+        }
+    }
+    return best;
+}
+
+
+#ifndef TREAP_NO_PARENT
+// In-order successor, by parent pointers; NULL after the last node. A full
+// walk touches every edge twice, so each step is amortised O(1).
+treap_node_t *treapNext(treap_node_t *node){
+    if(node->R != NULL){
+        node = node->R;
+        while(node->L != NULL) node = node->L;
+        return node;
+    }
+    while(node->P != NULL && node == node->P->R) node = node->P;
+    return node->P;
+}
+
+// In-order predecessor; NULL before the first node.
+treap_node_t *treapPrev(treap_node_t *node){
+    if(node->L != NULL){
+        node = node->L;
+        while(node->R != NULL) node = node->R;
+        return node;
+    }
+    while(node->P != NULL && node == node->P->L) node = node->P;
+    return node->P;
+}
+#endif
+
+
+// Leftmost and rightmost nodes of a subtree (NULL for an empty one)
+treap_node_t *treapFirst(treap_node_t *node){
+    if(node != NULL) while(node->L != NULL) node = node->L;
+    return node;
+}
+
+treap_node_t *treapLast(treap_node_t *node){
+    if(node != NULL) while(node->R != NULL) node = node->R;
+    return node;
+}
+
+
+// In-order iterator over a whole treap, stepping by parent pointers, so it needs
+// no stack however deep the tree is:
+//     for(treap_iter_t it = treapBegin(t); !treapIterEnd(it); treapIterNext(&it)) ... it.node ...
+// Mutating the treap invalidates it, except for decoupling a node other than
+// the current one.
+// With TREAP_NO_PARENT it keeps the ancestors still to be visited on a stack
+// instead, and any mutation invalidates it. The first TREAP_ITER_STACK entries
+// live in the iterator; a deeper tree grows a heap array for the rest, which is
+// freed on reaching the end. A walk abandoned before then must call
+// treapIterFinish.
+#define TREAP_ITER_STACK 64
+
+typedef struct treap_iter {
+    treap_node_t *node;         // Current node; NULL once past the end
+#ifdef TREAP_NO_PARENT
+    treap_node_t *stack[TREAP_ITER_STACK];
+    treap_node_t **deeper;      // Entries from TREAP_ITER_STACK on
+    size_t depth, capacity;     // capacity counts deeper's entries
+#endif
+} treap_iter_t;
+
+#ifdef TREAP_NO_PARENT
+static void treapIterPush(treap_iter_t *it, treap_node_t *node){
+    if(it->depth < TREAP_ITER_STACK){
+        it->stack[it->depth++] = node;
+        return;
+    }
+    if(it->depth - TREAP_ITER_STACK == it->capacity){
+        it->capacity = (it->capacity == 0) ? TREAP_ITER_STACK : it->capacity * 2;
+        it->deeper = (treap_node_t **)realloc(it->deeper, it->capacity * sizeof(treap_node_t *));
+        if(it->deeper == NULL){
+            fprintf(stderr, "treap: out of memory\n");
+            exit(1);
+        }
+    }
+    it->deeper[it->depth++ - TREAP_ITER_STACK] = node;
+}
+
+static inline treap_node_t *treapIterPop(treap_iter_t *it){
+    if(it->depth == 0) return NULL;
+    it->depth--;
+    return (it->depth < TREAP_ITER_STACK) ? it->stack[it->depth] : it->deeper[it->depth - TREAP_ITER_STACK];
+}
+#endif
+
+// Lets go of an iterator before its end (a no-op with parent pointers)
+static inline void treapIterFinish(treap_iter_t *it){
+#ifdef TREAP_NO_PARENT
+    free(it->deeper);
+    it->deeper = NULL;
+    it->capacity = 0;
+    it->depth = 0;
+#else
+    (void)it;
+#endif
+}
+
+// An iterator over the (sub)tree at root. With parent pointers, it carries on
+// past root's subtree, so root should be a treap's.
+treap_iter_t treapIterFrom(treap_node_t *root){
+    treap_iter_t it;
+#ifdef TREAP_NO_PARENT
+    it.deeper = NULL;
+    it.depth = 0;
+    it.capacity = 0;
+    for(treap_node_t *cur = root; cur != NULL; cur = cur->L) treapIterPush(&it, cur);
+    it.node = treapIterPop(&it);
+    if(it.node == NULL) treapIterFinish(&it);
+#else
+    it.node = treapFirst(root);
+#endif
+    return it;
+}
+
+treap_iter_t treapBegin(treap_t *treap){
+    return treapIterFrom(treap->root);
+}
+
+static inline int treapIterEnd(treap_iter_t it){
+    return it.node == NULL;
+}
+
+static inline void treapIterNext(treap_iter_t *it){
+#ifdef TREAP_NO_PARENT
+    treap_node_t *cur = it->node->R;
+    if(cur != NULL){
+        for(; cur->L != NULL; cur = cur->L) treapIterPush(it, cur);
+        it->node = cur;
+    } else {
+        it->node = treapIterPop(it);
+        if(it->node == NULL) treapIterFinish(it);
+    }
+#else
+    it->node = treapNext(it->node);
+#endif
+}
+
 
 // Like treapFind, but causes the found node to rise in the heap order
 // so that, by principle of locality, it is swiftly found again if popular.
-// TODO: Threadsafing considerations, this is a mutating operation
+// With TREAP_HASHED_PRIORITY the priorities are fixed by the keys, so there is
+// nothing to swap and this is an ordinary treapFind.
+// Under TREAP_THREADSAFE it also degrades to treapFind whenever the treap's lock
+// is busy, since promotion is only a hint.
 treap_node_t *treapUsurpingFind(treap_t *treap, unsigned int key){
+#ifdef TREAP_THREADSAFE
+    if(pthread_rwlock_trywrlock(&(treap->lock)) != 0) return treapFind(treap, key);
+#endif
+#if defined(TREAP_NO_PARENT) && !defined(TREAP_HASHED_PRIORITY)
+    // Find the node, remembering its parent and the link the parent hangs from
+    treap_node_t *cur = treap->root, *parent = NULL, **parentLink = NULL, **inPointer = &(treap->root);
+    while(cur != NULL && cur->treeKey != key){
+        parentLink = inPointer;
+        parent = cur;
+        inPointer = (key < cur->treeKey) ? &(cur->L) : &(cur->R);
+        cur = *inPointer;
+    }
+    if(cur != NULL && parent != NULL){
+        // Swap heapKeys, then rotate cur into its parent's place
+        unsigned int tempKey = cur->heapKey;
+        cur->heapKey = parent->heapKey;
+        parent->heapKey = tempKey;
+        if(cur == parent->L){
+            parent->L = cur->R;
+            cur->R = parent;
+        } else {
+            parent->R = cur->L;
+            cur->L = parent;
+        }
+        *parentLink = cur;
+    }
+#else
     // Find the node as before
-    treap_node_t *cur = treapFind(treap, key);
+    treap_node_t *cur = treapFindUnlocked(treap, key);
+#ifndef TREAP_HASHED_PRIORITY
     // Usurp the node's parent if the node exists and is not root
     if(cur != NULL && cur->P != NULL){
         // Switch heapKeys to preserve heap order
@@ -103,16 +1033,56 @@ treap_node_t *treapUsurpingFind(treap_t *treap, unsigned int key){
         cur->P->heapKey = tempKey;
         treapRotate(treap, cur->P, cur);
     }
+#endif
+#endif
+    TREAP_UNLOCK(treap);
     return cur;
 }
 
 
 
+#ifdef TREAP_NO_PARENT
+static void treapSplitNodes(treap_node_t *cur, unsigned int key, treap_node_t **l, treap_node_t **r);
+#endif
+
 // Add a new node to the treap OR checks to see if it already exists
-// Returns a pointer to the node, whether it was newly created or already exists
-// TODO: some way of informing the invoker whether the node was newly added or not?
-//       unless we want to give the treap a dictionary-style frontend...
-treap_node_t *treapAppend(treap_t *treap, unsigned int key){
+// Returns a pointer to the node, whether it was newly created or already exists;
+// *inserted (unless inserted is NULL) says which, in the same single descent.
+treap_node_t *treapInsertUnlocked(treap_t *treap, unsigned int key, int *inserted){
+#ifdef TREAP_NO_PARENT
+    // Top-down, with no rotations: make sure the key is absent, then descend
+    // again (over the path just walked) past the nodes that outrank the new
+    // one and split what hangs there around the new node. The priority is
+    // only drawn once a node is to be made, as in the rotating version.
+    for(treap_node_t *below = treap->root; below != NULL; below = (key < below->treeKey) ? below->L : below->R){
+        if(below->treeKey == key){
+            if(inserted != NULL) *inserted = 0;
+            return below;
+        }
+    }
+
+#ifdef TREAP_HASHED_PRIORITY
+    unsigned int heapKey = treapHashKey(key);
+#else
+    unsigned int heapKey = treapRandom(&(treap->rng));
+#endif
+    treap_node_t *cur = treap->root, **inPointer = &(treap->root);
+    while(cur != NULL && TREAP_PRIORITY(*cur) >= heapKey){
+        inPointer = (key < cur->treeKey) ? &(cur->L) : &(cur->R);
+        cur = *inPointer;
+    }
+
+    treap_node_t *newNode = treapNodeAlloc(treap);
+    newNode->treeKey = key;
+#ifndef TREAP_HASHED_PRIORITY
+    newNode->heapKey = heapKey;
+#endif
+    TREAP_CLEAR_VALUE(newNode);
+    treapSplitNodes(cur, key, &(newNode->L), &(newNode->R));
+    *inPointer = newNode;
+    if(inserted != NULL) *inserted = 1;
+    return newNode;
+#else
 
     // Binary seek to the location of the new node
     treap_node_t* cur = treap->root;
@@ -121,10 +1091,11 @@ treap_node_t *treapAppend(treap_t *treap, unsigned int key){
     // Check to see if treap is empty
     if (cur != NULL){
         treap_node_t* next;
-        while((next = (key < cur->treeKey)?cur->L:cur->R) != NULL) cur = next; 
+        while(key != cur->treeKey && (next = (key < cur->treeKey)?cur->L:cur->R) != NULL) cur = next; 
         // Now cur points to the 'parent' node, and next is the pointer
         if(key == cur->treeKey){
             // Desired node already exists
+            if(inserted != NULL) *inserted = 0;
             return cur;
         } else {
             inPointer = (key < cur->treeKey)?&(cur->L):&(cur->R);
@@ -132,35 +1103,83 @@ treap_node_t *treapAppend(treap_t *treap, unsigned int key){
     }
 
     // Generate a pseudo-random heap key
-    unsigned int heapKey = rand();
+#ifdef TREAP_HASHED_PRIORITY
+    unsigned int heapKey = treapHashKey(key);
+#else
+    unsigned int heapKey = treapRandom(&(treap->rng));
+#endif
 
     // New node is allocated and inserted
-    treap_node_t* newNode = (treap_node_t *)malloc(sizeof(treap_node_t));
+    treap_node_t* newNode = treapNodeAlloc(treap);
     newNode->P = cur;
     newNode->L = NULL;
     newNode->R = NULL;
     newNode->treeKey = key;
+#ifndef TREAP_HASHED_PRIORITY
     newNode->heapKey = heapKey;
+#endif
+    TREAP_CLEAR_VALUE(newNode);
     *inPointer = newNode;
+    treapUpdatePath(newNode);
     
     
     // Now perform priority rotations to ensure the node is in the right heap place
-    while(newNode->P != NULL && newNode->heapKey > newNode->P->heapKey){
+    while(newNode->P != NULL && heapKey > TREAP_PRIORITY(*newNode->P)){
         treapRotate(treap, newNode->P, newNode); 
     }
 
     // Finally hand back the new node
+    if(inserted != NULL) *inserted = 1;
     return newNode;
+#endif
+}
+
+treap_node_t *treapInsert(treap_t *treap, unsigned int key, int *inserted){
+    TREAP_WRITE_LOCK(treap);
+    treap_node_t *node = treapInsertUnlocked(treap, key, inserted);
+    TREAP_UNLOCK(treap);
+    return node;
+}
+
+// As treapInsert, for callers that do not need to know
+treap_node_t *treapAppendUnlocked(treap_t *treap, unsigned int key){
+    return treapInsertUnlocked(treap, key, NULL);
 }
 
+treap_node_t *treapAppend(treap_t *treap, unsigned int key){
+    return treapInsert(treap, key, NULL);
+}
+
+#ifdef TREAP_VALUE_TYPE
+// The node for key, which is added with the given value if it was missing (an
+// existing node keeps its value)
+treap_node_t *treapGetOrInsert(treap_t *treap, unsigned int key, TREAP_VALUE_TYPE value){
+    int inserted;
+    TREAP_WRITE_LOCK(treap);
+    treap_node_t *node = treapInsertUnlocked(treap, key, &inserted);
+    if(inserted) node->value = value;
+    TREAP_UNLOCK(treap);
+    return node;
+}
+#endif
 
 
+
+#ifdef TREAP_NO_PARENT
+int treapEraseKeyUnlocked(treap_t *treap, unsigned int key, treap_node_t **node);
+
+// remove a node from the treap: with no parent pointer to start from, this is
+// treapEraseKey on the node's key
+void treapDecoupleUnlocked(treap_t *treap, treap_node_t *node){
+    treap_node_t *found;
+    treapEraseKeyUnlocked(treap, node->treeKey, &found);
+}
+#else
 // remove a node from the treap
-// TODO: a version of this solely by key?
-void treapDecouple(treap_t *treap, treap_node_t *node){
+void treapDecoupleUnlocked(treap_t *treap, treap_node_t *node){
     // If Both Children are present then downswap until we reach a stable case
     while(!(node->L == NULL || node->R == NULL)){
-        if(node->L->heapKey > node->R->heapKey){
+        if(TREAP_PRIORITY(*node->L) > TREAP_PRIORITY(*node->R)){
             // Swap with Left Child
             treapRotate(treap, node, node->L);
         } else {
@@ -191,121 +1210,4551 @@ void treapDecouple(treap_t *treap, treap_node_t *node){
         // Leaf Case
         *inPointer = NULL;
     }
-    // Now node is totally decoupled from the treap (but not deallocated from memory)
+    treapUpdatePath(node->P);
+    // Now node is totally decoupled from the treap (but not deallocated from memory;
+    // hand it to treapRelease once finished with it, or to treapRetire if readers
+    // may still be holding it)
 }
+#endif
 
+void treapDecouple(treap_t *treap, treap_node_t *node){
+    TREAP_WRITE_LOCK(treap);
+    treapDecoupleUnlocked(treap, node);
+    TREAP_UNLOCK(treap);
+}
 
 
+// Gives back the buckets retired at least two epochs before epoch
+static void treapReclaim(treap_t *treap, uint64_t epoch){
+    for(int i = 0; i < 3; i++){
+        treap_limbo_t *bucket = &(treap->limbo[i]);
+        if(bucket->nodes != NULL && bucket->epoch + 2 <= epoch){
+            treapReleaseTree(treap, bucket->nodes);
+            bucket->nodes = NULL;
+        }
+    }
+}
+
+// Releases a decoupled node once no reader inside an epoch bracket can still be
+// holding it. Only the node's key (and priority) stay readable meanwhile: its
+// links are reused to queue it, so readers must not navigate from it unlocked.
+// Takes O(1); the nodes go back to the pool in batches.
+void treapRetireUnlocked(treap_t *treap, treap_node_t *node){
+    uint64_t epoch = atomic_load(&treapEpochGlobal);
+    treap_limbo_t *bucket = &(treap->limbo[epoch % 3]);
+    if(bucket->epoch != epoch){
+        // Left over from three or more epochs ago
+        treapReleaseTree(treap, bucket->nodes);
+        bucket->nodes = NULL;
+        bucket->epoch = epoch;
+    }
+    node->L = bucket->nodes;
+    node->R = NULL;
+    bucket->nodes = node;
+    if(++(treap->retiredSinceAdvance) >= TREAP_EPOCH_BATCH){
+        treap->retiredSinceAdvance = 0;
+        treapReclaim(treap, treapEpochAdvance());
+    }
+}
 
+void treapRetire(treap_t *treap, treap_node_t *node){
+    TREAP_WRITE_LOCK(treap);
+    treapRetireUnlocked(treap, node);
+    TREAP_UNLOCK(treap);
+}
 
 
 
+// Split and join work top-down on bare subtrees: each walks a single path and
+// stitches the pieces together as it goes, fixing parent pointers (if any) on the way.
 
+// Divides the subtree at cur into keys below key (returned through l) and the
+// rest (through r).
+static void treapSplitNodes(treap_node_t *cur, unsigned int key, treap_node_t **l, treap_node_t **r){
+    treap_node_t **lHook = l, **rHook = r;
+    treap_node_t *lParent = NULL, *rParent = NULL;
+    while(cur != NULL){
+        if(cur->treeKey < key){
+            *lHook = cur;
+            TREAP_SET_PARENT(cur, lParent);
+            lParent = cur;
+            lHook = &(cur->R);
+            cur = cur->R;
+        } else {
+            *rHook = cur;
+            TREAP_SET_PARENT(cur, rParent);
+            rParent = cur;
+            rHook = &(cur->L);
+            cur = cur->L;
+        }
+    }
+    *lHook = NULL;
+    *rHook = NULL;
+    treapUpdatePath(lParent);
+    treapUpdatePath(rParent);
+}
 
-// Test Drivers
-void printTreapKernel(treap_node_t * node){
-    if(node != NULL){
-        printf("  [");
-        printTreapKernel(node->L);
-        printf("]-%d-[", node->treeKey);
-        printTreapKernel(node->R);
-        printf("]  ");
-    } else {
-        printf(".");
+// Merges two subtrees where every key in a is below every key in b.
+static treap_node_t *treapJoinNodes(treap_node_t *a, treap_node_t *b){
+    treap_node_t *root = NULL, **hook = &root, *parent = NULL;
+    while(a != NULL && b != NULL){
+        if(TREAP_PRIORITY(*a) > TREAP_PRIORITY(*b)){
+            *hook = a;
+            TREAP_SET_PARENT(a, parent);
+            parent = a;
+            hook = &(a->R);
+            a = a->R;
+        } else {
+            *hook = b;
+            TREAP_SET_PARENT(b, parent);
+            parent = b;
+            hook = &(b->L);
+            b = b->L;
+        }
     }
+    *hook = (a != NULL) ? a : b;
+    if(*hook != NULL) TREAP_SET_PARENT(*hook, parent);
+    treapUpdatePath(parent);
+    return root;
 }
 
-void printTreap(treap_t *treap){
-    printTreapKernel(treap->root);
-    printf("\n");
+// Points an empty treap at src's pool, dropping whatever pool it had
+static void treapSharePool(treap_t *dst, treap_t *src){
+    if(dst->pool == src->pool) return;
+    treapReset(dst);
+    dst->pool = src->pool;
+    treapPoolRef(dst->pool);
 }
 
 
-void testInOrder(treap_node_t *node, unsigned int *value){
-    if(node->L != NULL) testInOrder(node->L, value);
-    if(node->L != NULL && node->L->treeKey >= node->treeKey) *value = 0;
-    if(node->R != NULL && node->R->treeKey <= node->treeKey) *value = 0;
-    if(node->R != NULL) testInOrder(node->R, value);
+// Moves the keys below key into left and the rest into right, in expected
+// O(log n). left and right must be empty, though either may be treap itself;
+// both end up sharing treap's pool.
+void treapSplit(treap_t *treap, unsigned int key, treap_t *left, treap_t *right){
+    treap_node_t *l, *r;
+    treapSplitNodes(treap->root, key, &l, &r);
+    treap->root = NULL;
+    treapSharePool(left, treap);
+    treapSharePool(right, treap);
+    left->root = l;
+    right->root = r;
 }
 
-unsigned int properParentTest(treap_node_t* root){
-    if(root == NULL){
-        return 0;
-    } else {
-        return properParentTest(root->L) + properParentTest(root->R) + ((root->P == NULL)?1:0);
+
+// Removes key in a single descent: its node is replaced by the join of its two
+// subtrees, with no separate find and no rotations. Returns 1 if key was
+// present. The node is released, unless node is not NULL, in which case it is
+// handed back (decoupled, as from treapDecouple) for reuse; *node is NULL if
+// key was absent.
+int treapEraseKeyUnlocked(treap_t *treap, unsigned int key, treap_node_t **node){
+    treap_node_t *cur = treap->root, **inPointer = &(treap->root);
+    while(cur != NULL && cur->treeKey != key){
+        inPointer = (key < cur->treeKey) ? &(cur->L) : &(cur->R);
+        cur = *inPointer;
     }
+    if(node != NULL) *node = cur;
+    if(cur == NULL) return 0;
+    treap_node_t *joined = treapJoinNodes(cur->L, cur->R);
+    *inPointer = joined;
+#ifndef TREAP_NO_PARENT
+    if(joined != NULL) joined->P = cur->P;
+    treapUpdatePath(cur->P);
+#endif
+    if(node == NULL) treapRelease(treap, cur);
+    return 1;
 }
 
+int treapEraseKey(treap_t *treap, unsigned int key, treap_node_t **node){
+    TREAP_WRITE_LOCK(treap);
+    int found = treapEraseKeyUnlocked(treap, key, node);
+    TREAP_UNLOCK(treap);
+    return found;
+}
 
-int getMaxHeight(treap_node_t* root) {
-   int left = ((root->L == NULL) ? 0 :  1 + getMaxHeight(root->L));
-   int right = ((root->R == NULL) ? 0 : 1 + getMaxHeight(root->R));
-   return ((right > left) ? right : left);
+// Removes key and releases its node; returns 1 if it was present.
+int treapErase(treap_t *treap, unsigned int key){
+    return treapEraseKey(treap, key, NULL);
 }
 
 
-// First test; established treap function w/ order maintenance over multiple deletes
-double testOne(unsigned int times){
-    printf("\nRunning %u times!\n", times);
-    treap_t bob;
-    bob.root = NULL;
-    for(unsigned int i = 0; i < times; i++){
+// Appends right onto left, leaving right empty, in expected O(log n). Every key
+// in left must be below every key in right. If right draws on a different pool,
+// left adopts it (see treapAdoptPool).
+void treapJoin(treap_t *left, treap_t *right){
+    treapAdoptPool(left, right);
+    left->root = treapJoinNodes(left->root, right->root);
+    right->root = NULL;
+}
+
+
+// Builds the treap from n ascending keys in O(n) (repeats are skipped), instead
+// of n appends that each rotate up the right spine. The treap must be empty.
+// This is the Cartesian-tree construction: each new node goes on the bottom of
+// the right spine, after climbing past any lower-priority spine nodes, which
+// become its left subtree. Parent pointers serve as the spine stack (without
+// them, a growable array does).
+void treapBuildSorted(treap_t *treap, const unsigned int *keys, size_t n){
+    treap_node_t *block = treapNodeAllocBlock(treap, n);
+    treap_node_t *last = NULL;
+    size_t used = 0;
+#ifdef TREAP_NO_PARENT
+    treap_node_t **spine = NULL;
+    size_t depth = 0, capacity = 0;
+#endif
+    for(size_t i = 0; i < n; i++){
+        if(last != NULL && keys[i] <= last->treeKey) continue;
+        treap_node_t *node = (block != NULL) ? &block[used++] : treapNodeAlloc(treap);
+        node->treeKey = keys[i];
+        TREAP_CLEAR_VALUE(node);
+#ifdef TREAP_HASHED_PRIORITY
+        unsigned int heapKey = treapHashKey(keys[i]);
+#else
+        unsigned int heapKey = treapRandom(&(treap->rng));
+        node->heapKey = heapKey;
+#endif
+        node->R = NULL;
+        treap_node_t *below = NULL;
+#ifdef TREAP_NO_PARENT
+        while(depth > 0 && TREAP_PRIORITY(*spine[depth - 1]) < heapKey) below = spine[--depth];
+        last = (depth > 0) ? spine[depth - 1] : NULL;
+#else
+        while(last != NULL && TREAP_PRIORITY(*last) < heapKey){
+            below = last;
+            last = last->P;
+        }
+#endif
+        node->L = below;
+        if(below != NULL) TREAP_SET_PARENT(below, node);
+        TREAP_SET_PARENT(node, last);
+        if(last != NULL) last->R = node;
+#ifdef TREAP_NO_PARENT
+        if(depth == capacity){
+            capacity = (capacity == 0) ? 64 : capacity * 2;
+            spine = (treap_node_t **)realloc(spine, capacity * sizeof(treap_node_t *));
+            if(spine == NULL){
+                fprintf(stderr, "treap: out of memory\n");
+                exit(1);
+            }
+        }
+        spine[depth++] = node;
+#endif
+        last = node;
+    }
+    // The topmost spine node is the root
+#ifdef TREAP_NO_PARENT
+    treap->root = (depth > 0) ? spine[0] : NULL;
+    free(spine);
+#else
+    while(last != NULL && last->P != NULL) last = last->P;
+    treap->root = last;
+#endif
+
+#ifdef TREAP_SIZES
+    // Sizes in one post-order pass, walking parent pointers instead of a stack
+    treap_node_t *cur = last, *prev = NULL;
+    while(cur != NULL){
+        if(prev == cur->P && cur->L != NULL){
+            prev = cur;
+            cur = cur->L;
+        } else if((prev == cur->P || prev == cur->L) && cur->R != NULL){
+            prev = cur;
+            cur = cur->R;
+        } else {
+            treapUpdate(cur);
+            prev = cur;
+            cur = cur->P;
+        }
+    }
+#endif
+
+    // Slots left over by repeated keys go to the free list
+    if(block != NULL){
+        for(size_t i = used; i < n; i++) treapRelease(treap, &block[i]);
+    }
+}
+
+
+#ifdef TREAP_SIZES
+// The k-th smallest node (counting from 0), or NULL if k is out of range.
+treap_node_t *treapSelect(treap_t *treap, unsigned int k){
+    treap_node_t *cur = treap->root;
+    while(cur != NULL){
+        unsigned int left = TREAP_SIZE(cur->L);
+        if(k < left){
+            cur = cur->L;
+        } else if(k > left){
+            k -= left + 1;
+            cur = cur->R;
+        } else {
+            return cur;
+        }
+    }
+    return NULL;
+}
+
+// How many keys in the treap are below key.
+unsigned int treapRank(treap_t *treap, unsigned int key){
+    unsigned int rank = 0;
+    treap_node_t *cur = treap->root;
+    while(cur != NULL){
+        if(key <= cur->treeKey){
+            cur = cur->L;
+        } else {
+            rank += TREAP_SIZE(cur->L) + 1;
+            cur = cur->R;
+        }
+    }
+    return rank;
+}
+#endif
+
+
+// Removes every key in [lo, hi), in expected O(log n) whatever the range holds.
+void treapEraseRange(treap_t *treap, unsigned int lo, unsigned int hi){
+    if(hi <= lo) return;
+    treap_node_t *below, *rest, *middle, *above;
+    treapSplitNodes(treap->root, lo, &below, &rest);
+    treapSplitNodes(rest, hi, &middle, &above);
+    treap->root = treapJoinNodes(below, above);
+    treapReleaseTree(treap, middle);
+}
+
+
+// Moves every key in [lo, hi) into out, which must be empty and ends up sharing
+// treap's pool. Expected O(log n).
+void treapExtractRange(treap_t *treap, unsigned int lo, unsigned int hi, treap_t *out){
+    treap_node_t *below, *rest, *middle = NULL, *above;
+    treapSharePool(out, treap);
+    if(hi <= lo) return;
+    treapSplitNodes(treap->root, lo, &below, &rest);
+    treapSplitNodes(rest, hi, &middle, &above);
+    treap->root = treapJoinNodes(below, above);
+    out->root = middle;
+}
+
+
+
+// A small fork-join thread pool for the bulk operations. Forked tasks go on a
+// shared stack; a thread waiting for its own task to finish runs queued tasks
+// (most likely that very one) rather than sleeping, so nested forks never
+// deadlock however few workers there are.
+typedef struct treap_task {
+    void (*run)(void *arg);
+    void *arg;
+    int done;                   // Guarded by the pool lock
+    struct treap_task *next;
+} treap_task_t;
+
+typedef struct treap_workers {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;        // Signalled on new work, finished work and shutdown
+    treap_task_t *queue;
+    pthread_t *threads;
+    int count;
+    int stopping;
+} treap_workers_t;
+
+
+static treap_task_t *treapTaskPop(treap_workers_t *workers){
+    treap_task_t *task = workers->queue;
+    if(task != NULL) workers->queue = task->next;
+    return task;
+}
+
+// Runs a task with the pool unlocked; returns with it locked again
+static void treapTaskRun(treap_workers_t *workers, treap_task_t *task){
+    pthread_mutex_unlock(&(workers->lock));
+    task->run(task->arg);
+    pthread_mutex_lock(&(workers->lock));
+    task->done = 1;
+    pthread_cond_broadcast(&(workers->wake));
+}
+
+static void *treapWorkerMain(void *arg){
+    treap_workers_t *workers = (treap_workers_t *)arg;
+    pthread_mutex_lock(&(workers->lock));
+    while(!workers->stopping){
+        treap_task_t *task = treapTaskPop(workers);
+        if(task != NULL){
+            treapTaskRun(workers, task);
+        } else {
+            pthread_cond_wait(&(workers->wake), &(workers->lock));
+        }
+    }
+    pthread_mutex_unlock(&(workers->lock));
+    return NULL;
+}
+
+// Starts count worker threads (the calling thread also works while it waits).
+void treapWorkersStart(treap_workers_t *workers, int count){
+    pthread_mutex_init(&(workers->lock), NULL);
+    pthread_cond_init(&(workers->wake), NULL);
+    workers->queue = NULL;
+    workers->stopping = 0;
+    workers->count = count;
+    workers->threads = (pthread_t *)malloc(count * sizeof(pthread_t));
+    for(int i = 0; i < count; i++){
+        pthread_create(&(workers->threads[i]), NULL, treapWorkerMain, workers);
+    }
+}
+
+void treapWorkersStop(treap_workers_t *workers){
+    pthread_mutex_lock(&(workers->lock));
+    workers->stopping = 1;
+    pthread_cond_broadcast(&(workers->wake));
+    pthread_mutex_unlock(&(workers->lock));
+    for(int i = 0; i < workers->count; i++) pthread_join(workers->threads[i], NULL);
+    free(workers->threads);
+    pthread_cond_destroy(&(workers->wake));
+    pthread_mutex_destroy(&(workers->lock));
+}
+
+// Queues a task for any thread to pick up. The task must stay alive until
+// treapSync on it returns.
+static void treapFork(treap_workers_t *workers, treap_task_t *task){
+    task->done = 0;
+    pthread_mutex_lock(&(workers->lock));
+    task->next = workers->queue;
+    workers->queue = task;
+    pthread_cond_signal(&(workers->wake));
+    pthread_mutex_unlock(&(workers->lock));
+}
+
+// Waits for a forked task, running queued work in the meantime
+static void treapSync(treap_workers_t *workers, treap_task_t *task){
+    pthread_mutex_lock(&(workers->lock));
+    while(!task->done){
+        treap_task_t *other = treapTaskPop(workers);
+        if(other != NULL){
+            treapTaskRun(workers, other);
+        } else {
+            pthread_cond_wait(&(workers->wake), &(workers->lock));
+        }
+    }
+    pthread_mutex_unlock(&(workers->lock));
+}
+
+
+
+// Join-based set operations (Blelloch & Reid-Miller): the higher-priority root
+// splits the other tree, and the two halves recurse independently, which is
+// where the work is forked. Expected work is O(m log(n/m + 1)) for sizes m <= n.
+// Both trees' nodes must share a pool first; nodes the result does not keep
+// are gathered as a chain of subtree roots (linked like the pool's free list)
+// and handed back to the pool in one step at the end.
+
+// Forking stops at this depth (beyond what is needed to feed every worker)
+#define TREAP_FORK_DEPTH 8
+
+typedef struct treap_discard {
+    treap_node_t *head, *tail;
+} treap_discard_t;
+
+static void treapDiscard(treap_discard_t *discard, treap_node_t *node){
+    if(node == NULL) return;
+    treapChainSet(node, discard->head);
+    discard->head = node;
+    if(discard->tail == NULL) discard->tail = node;
+}
+
+static void treapDiscardMerge(treap_discard_t *into, treap_discard_t *from){
+    if(from->head == NULL) return;
+    treapChainSet(from->tail, into->head);
+    into->head = from->head;
+    if(into->tail == NULL) into->tail = from->tail;
+}
+
+static void treapDiscardRelease(treap_t *treap, treap_discard_t *discard){
+    if(discard->head == NULL) return;
+#ifdef TREAP_MALLOC_NODES
+    treap_node_t *cur = discard->head;
+    while(cur != NULL){
+        treap_node_t *next = treapChainNext(cur);
+        treapReleaseTree(treap, cur);
+        cur = next;
+    }
+#else
+    TREAP_POOL_LOCK(treap->pool);
+    treapChainSet(discard->tail, treap->pool->freeList);
+    treap->pool->freeList = discard->head;
+    TREAP_POOL_UNLOCK(treap->pool);
+#endif
+}
+
+// Three-way split: keys below key into l, above into r, and the node holding
+// key itself (detached, or NULL) is returned.
+static treap_node_t *treapSplitNodes3(treap_node_t *cur, unsigned int key, treap_node_t **l, treap_node_t **r){
+    treap_node_t **lHook = l, **rHook = r;
+    treap_node_t *lParent = NULL, *rParent = NULL;
+    while(cur != NULL){
+        if(cur->treeKey < key){
+            *lHook = cur;
+            TREAP_SET_PARENT(cur, lParent);
+            lParent = cur;
+            lHook = &(cur->R);
+            cur = cur->R;
+        } else if(cur->treeKey > key){
+            *rHook = cur;
+            TREAP_SET_PARENT(cur, rParent);
+            rParent = cur;
+            rHook = &(cur->L);
+            cur = cur->L;
+        } else {
+            *lHook = cur->L;
+            if(cur->L != NULL) TREAP_SET_PARENT(cur->L, lParent);
+            *rHook = cur->R;
+            if(cur->R != NULL) TREAP_SET_PARENT(cur->R, rParent);
+            cur->L = NULL;
+            cur->R = NULL;
+            treapUpdatePath(lParent);
+            treapUpdatePath(rParent);
+            return cur;
+        }
+    }
+    *lHook = NULL;
+    *rHook = NULL;
+    treapUpdatePath(lParent);
+    treapUpdatePath(rParent);
+    return NULL;
+}
+
+static void treapAttach(treap_node_t *node, treap_node_t *l, treap_node_t *r){
+    node->L = l;
+    if(l != NULL) TREAP_SET_PARENT(l, node);
+    node->R = r;
+    if(r != NULL) TREAP_SET_PARENT(r, node);
+    treapUpdate(node);
+}
+
+
+typedef enum { TREAP_UNION, TREAP_INTERSECT, TREAP_DIFFERENCE } treap_setop_t;
+
+typedef struct treap_setop_job {
+    treap_setop_t op;
+    treap_node_t *a, *b;
+    treap_workers_t *workers;
+    int depth;
+    treap_node_t *result;
+    treap_discard_t discard;
+} treap_setop_job_t;
+
+static treap_node_t *treapSetOpNodes(treap_setop_t op, treap_node_t *a, treap_node_t *b,
+                                     treap_workers_t *workers, int depth, treap_discard_t *discard);
+
+static void treapSetOpTask(void *arg){
+    treap_setop_job_t *job = (treap_setop_job_t *)arg;
+    job->result = treapSetOpNodes(job->op, job->a, job->b, job->workers, job->depth, &(job->discard));
+}
+
+// Recurses on the (a, b) pairs either side of the splitting key, in parallel
+// near the top of the tree.
+static void treapSetOpHalves(treap_setop_t op, treap_node_t *aL, treap_node_t *bL, treap_node_t *aR, treap_node_t *bR,
+                             treap_workers_t *workers, int depth, treap_discard_t *discard,
+                             treap_node_t **l, treap_node_t **r){
+    if(workers != NULL && depth < TREAP_FORK_DEPTH && (aL != NULL || bL != NULL) && (aR != NULL || bR != NULL)){
+        treap_setop_job_t job = {op, aR, bR, workers, depth + 1, NULL, {NULL, NULL}};
+        treap_task_t task = {treapSetOpTask, &job, 0, NULL};
+        treapFork(workers, &task);
+        *l = treapSetOpNodes(op, aL, bL, workers, depth + 1, discard);
+        treapSync(workers, &task);
+        *r = job.result;
+        treapDiscardMerge(discard, &(job.discard));
+    } else {
+        *l = treapSetOpNodes(op, aL, bL, workers, depth + 1, discard);
+        *r = treapSetOpNodes(op, aR, bR, workers, depth + 1, discard);
+    }
+}
+
+static treap_node_t *treapSetOpNodes(treap_setop_t op, treap_node_t *a, treap_node_t *b,
+                                     treap_workers_t *workers, int depth, treap_discard_t *discard){
+    if(a == NULL || b == NULL){
+        switch(op){
+        case TREAP_UNION:
+            return (a != NULL) ? a : b;
+        case TREAP_INTERSECT:
+            treapDiscard(discard, a);
+            treapDiscard(discard, b);
+            return NULL;
+        default:
+            treapDiscard(discard, b);
+            return a;
+        }
+    }
+
+    // Whichever root has the higher priority stays on top and splits the other
+    int aOnTop = TREAP_PRIORITY(*a) >= TREAP_PRIORITY(*b);
+    treap_node_t *top = aOnTop ? a : b;
+    treap_node_t *other = aOnTop ? b : a;
+    treap_node_t *topL = top->L, *topR = top->R, *otherL, *otherR;
+    treap_node_t *match = treapSplitNodes3(other, top->treeKey, &otherL, &otherR);
+    treap_node_t *l, *r;
+    if(aOnTop){
+        treapSetOpHalves(op, topL, otherL, topR, otherR, workers, depth, discard, &l, &r);
+    } else {
+        treapSetOpHalves(op, otherL, topL, otherR, topR, workers, depth, discard, &l, &r);
+    }
+
+    // Does top's key survive? Union: always. Intersection: only if matched.
+    // Difference: only if it is a's and unmatched.
+    int keep = (op == TREAP_UNION) || (op == TREAP_INTERSECT && match != NULL)
+               || (op == TREAP_DIFFERENCE && aOnTop && match == NULL);
+    if(keep && !aOnTop && match != NULL){
+        // A key in both keeps a's node, which takes b's place and priority
+#ifndef TREAP_HASHED_PRIORITY
+        match->heapKey = top->heapKey;
+#endif
+        treap_node_t *dropped = top;
+        top = match;
+        match = dropped;
+        match->L = NULL;
+        match->R = NULL;
+    }
+    treapDiscard(discard, match);
+    if(keep){
+        treapAttach(top, l, r);
+        TREAP_SET_PARENT(top, NULL);
+        return top;
+    }
+    top->L = NULL;
+    top->R = NULL;
+    treapDiscard(discard, top);
+    return treapJoinNodes(l, r);
+}
+
+static void treapSetOp(treap_setop_t op, treap_t *a, treap_t *b, treap_workers_t *workers){
+    treapAdoptPool(a, b);
+    treap_discard_t discard = {NULL, NULL};
+    a->root = treapSetOpNodes(op, a->root, b->root, workers, 0, &discard);
+    if(a->root != NULL) TREAP_SET_PARENT(a->root, NULL);
+    b->root = NULL;
+    treapDiscardRelease(a, &discard);
+}
+
+
+// Destructive bulk set operations: the result is left in a and b is emptied.
+// Nodes move between the trees, so b's pool is adopted by a as in treapJoin.
+// a's nodes are kept for keys present in both; b's are released. workers may
+// be NULL to run on the calling thread alone.
+void treapUnion(treap_t *a, treap_t *b, treap_workers_t *workers){
+    treapSetOp(TREAP_UNION, a, b, workers);
+}
+
+void treapIntersect(treap_t *a, treap_t *b, treap_workers_t *workers){
+    treapSetOp(TREAP_INTERSECT, a, b, workers);
+}
+
+void treapDifference(treap_t *a, treap_t *b, treap_workers_t *workers){
+    treapSetOp(TREAP_DIFFERENCE, a, b, workers);
+}
+
+
+// Batch forms of treapAppend and of find-decouple-release, for n ascending keys
+// (repeats allowed). The batch is built into a treap of its own in O(n) and
+// merged in with treapUnion or treapDifference, which split the treap around the
+// batch's keys and fork the pieces onto workers (NULL for the calling thread
+// alone). Expected O(n log(size/n + 1)) work rather than O(n log size) one key
+// at a time. Keys already present keep their nodes. Both take the lock.
+static void treapBatchOp(treap_setop_t op, treap_t *treap, const unsigned int *keys, size_t n,
+                         treap_workers_t *workers){
+    treap_t batch;
+    TREAP_WRITE_LOCK(treap);
+    treapInitShared(&batch, treap);
+    treapBuildSorted(&batch, keys, n);
+    treapSetOp(op, treap, &batch, workers);
+    TREAP_UNLOCK(treap);
+    treapDestroy(&batch);
+}
+
+void treapInsertBatch(treap_t *treap, const unsigned int *keys, size_t n, treap_workers_t *workers){
+    treapBatchOp(TREAP_UNION, treap, keys, n, workers);
+}
+
+void treapEraseBatch(treap_t *treap, const unsigned int *keys, size_t n, treap_workers_t *workers){
+    treapBatchOp(TREAP_DIFFERENCE, treap, keys, n, workers);
+}
+
+
+
+
+
+
+
+
+// Sharded variant: the key space is cut into ranges, each held by a treap of
+// its own, so writers to different ranges never meet on a lock (nor, since each
+// shard has its own pool and generator, anywhere else). Shard i holds the keys
+// from lo[i] up to lo[i + 1] - 1. The ranges start out even; streapRebalance
+// moves them so that each shard holds about as many keys, which is what dense or
+// clustered keys such as sequential IDs need.
+typedef struct streap_shard {
+    _Alignas(64) treap_t treap;     // Padded so no two shards share a cache line
+} streap_shard_t;
+
+typedef struct streap {
+
+    streap_shard_t *shards;
+    unsigned int *lo;               // Lowest key of each shard; lo[0] is 0
+    unsigned int count;
+
+} streap_t;
+
+
+// Prepares a streap of count shards with even ranges; count must be at least 1,
+// since every key needs a shard to fall in.
+void streapInit(streap_t *streap, unsigned int count){
+    if(count == 0){
+        fprintf(stderr, "streap: needs at least one shard\n");
+        exit(1);
+    }
+    streap->count = count;
+    streap->shards = (streap_shard_t *)aligned_alloc(_Alignof(streap_shard_t), count * sizeof(streap_shard_t));
+    streap->lo = (unsigned int *)malloc(count * sizeof(unsigned int));
+    if(streap->shards == NULL || streap->lo == NULL){
+        fprintf(stderr, "streap: out of memory\n");
+        exit(1);
+    }
+    for(unsigned int i = 0; i < count; i++){
+        treapInit(&(streap->shards[i].treap));
+        streap->lo[i] = (unsigned int)(((uint64_t)i << 32) / count);
+    }
+}
+
+void streapDestroy(streap_t *streap){
+    for(unsigned int i = 0; i < streap->count; i++) treapDestroy(&(streap->shards[i].treap));
+    free(streap->shards);
+    free(streap->lo);
+}
+
+
+// The shard responsible for key
+treap_t *streapShard(streap_t *streap, unsigned int key){
+    unsigned int first = 0, last = streap->count - 1;
+    while(first < last){
+        unsigned int mid = first + (last - first + 1) / 2;
+        if(streap->lo[mid] <= key){
+            first = mid;
+        } else {
+            last = mid - 1;
+        }
+    }
+    return &(streap->shards[first].treap);
+}
+
+// As treapFind, treapAppend and so on; each locks just the shard concerned
+treap_node_t *streapFind(streap_t *streap, unsigned int key){
+    return treapFind(streapShard(streap, key), key);
+}
+
+treap_node_t *streapAppend(streap_t *streap, unsigned int key){
+    return treapAppend(streapShard(streap, key), key);
+}
+
+void streapDecouple(streap_t *streap, treap_node_t *node){
+    treapDecouple(streapShard(streap, node->treeKey), node);
+}
+
+void streapRelease(streap_t *streap, treap_node_t *node){
+    treapRelease(streapShard(streap, node->treeKey), node);
+}
+
+void streapRetire(streap_t *streap, treap_node_t *node){
+    treapRetire(streapShard(streap, node->treeKey), node);
+}
+
+
+// Lock or unlock every shard, always in the same order, for iteration and the
+// like. With TREAP_THREADSAFE, anything compound on one shard can instead lock
+// streapShard(streap, key) alone.
+void streapLockShared(streap_t *streap){
+    for(unsigned int i = 0; i < streap->count; i++) treapLockShared(&(streap->shards[i].treap));
+}
+
+void streapLockExclusive(streap_t *streap){
+    for(unsigned int i = 0; i < streap->count; i++) treapLockExclusive(&(streap->shards[i].treap));
+}
+
+void streapUnlock(streap_t *streap){
+    for(unsigned int i = streap->count; i-- > 0; ) treapUnlock(&(streap->shards[i].treap));
+}
+
+
+// In-order iteration across all shards; the caller holds them locked:
+//     for(streap_iter_t it = streapBegin(&bob); !streapIterEnd(it); streapIterNext(&it))
+typedef struct streap_iter {
+    streap_t *streap;
+    unsigned int shard;
+    treap_iter_t within;        // Position in the current shard
+    treap_node_t *node;         // Current node; NULL once past the end
+} streap_iter_t;
+
+// Moves on to the first node of the first non-empty shard from it->shard on
+static void streapIterSettle(streap_iter_t *it){
+    while(it->within.node == NULL && ++(it->shard) < it->streap->count){
+        it->within = treapBegin(&(it->streap->shards[it->shard].treap));
+    }
+    it->node = it->within.node;
+}
+
+streap_iter_t streapBegin(streap_t *streap){
+    streap_iter_t it;
+    it.streap = streap;
+    it.shard = 0;
+    it.within = treapBegin(&(streap->shards[0].treap));
+    streapIterSettle(&it);
+    return it;
+}
+
+static inline int streapIterEnd(streap_iter_t it){
+    return it.node == NULL;
+}
+
+static inline void streapIterNext(streap_iter_t *it){
+    treapIterNext(&(it->within));
+    streapIterSettle(it);
+}
+
+// Lets go of an iterator before its end, as treapIterFinish
+static inline void streapIterFinish(streap_iter_t *it){
+    treapIterFinish(&(it->within));
+}
+
+
+// Appends copies of a detached subtree's nodes to a growing array, then
+// releases it
+static void streapCollect(treap_t *treap, treap_node_t *root, treap_node_t **nodes, size_t *count, size_t *capacity){
+    if(root == NULL) return;
+    for(treap_iter_t it = treapIterFrom(root); !treapIterEnd(it); treapIterNext(&it)){
+        treap_node_t *node = it.node;
+        if(*count == *capacity){
+            *capacity = (*capacity == 0) ? 1024 : *capacity * 2;
+            *nodes = (treap_node_t *)realloc(*nodes, *capacity * sizeof(treap_node_t));
+            if(*nodes == NULL){
+                fprintf(stderr, "streap: out of memory\n");
+                exit(1);
+            }
+        }
+        (*nodes)[(*count)++] = *node;
+    }
+    treapReleaseTree(treap, root);
+}
+
+// Redraws the shard ranges so that each holds an equal share of the keys, moving
+// keys and values (not nodes: every shard keeps its own pool) between shards.
+// O(n) for the count plus O(log n) per key moved; every node handed out before
+// is invalidated. Nothing else may be using the streap meanwhile.
+void streapRebalance(streap_t *streap){
+    size_t total = 0;
+    for(streap_iter_t it = streapBegin(streap); !streapIterEnd(it); streapIterNext(&it)) total++;
+    if(total < streap->count) return;
+
+    // Shard i will start at the key of rank i * total / count
+    unsigned int *lo = (unsigned int *)malloc(streap->count * sizeof(unsigned int));
+    if(lo == NULL){
+        fprintf(stderr, "streap: out of memory\n");
+        exit(1);
+    }
+    lo[0] = 0;
+    unsigned int next = 1;
+    size_t rank = 0;
+    streap_iter_t it = streapBegin(streap);
+    for(; next < streap->count; streapIterNext(&it), rank++){
+        if(rank == next * total / streap->count) lo[next++] = it.node->treeKey;
+    }
+    streapIterFinish(&it);
+
+    // Cut what falls outside its new range from each shard, then put it back
+    treap_node_t *nodes = NULL;
+    size_t moved = 0, capacity = 0;
+    for(unsigned int i = 0; i < streap->count; i++){
+        treap_t *treap = &(streap->shards[i].treap);
+        treap_node_t *below, *middle, *above = NULL;
+        treapSplitNodes(treap->root, lo[i], &below, &middle);
+        if(i + 1 < streap->count) treapSplitNodes(middle, lo[i + 1], &middle, &above);
+        treap->root = middle;
+        streapCollect(treap, below, &nodes, &moved, &capacity);
+        streapCollect(treap, above, &nodes, &moved, &capacity);
+    }
+    free(streap->lo);
+    streap->lo = lo;
+    for(size_t k = 0; k < moved; k++){
+        treap_node_t *node = treapAppendUnlocked(streapShard(streap, nodes[k].treeKey), nodes[k].treeKey);
+#ifdef TREAP_VALUE_TYPE
+        node->value = nodes[k].value;
+#else
+        (void)node;
+#endif
+    }
+    free(nodes);
+}
+
+
+
+
+
+
+
+
+// Frozen snapshots: for read-mostly phases, treapFreeze copies a treap's keys
+// (and values) into one immutable, pointer-free array. The array holds a
+// complete binary search tree in van Emde Boas order: the tree is cut at half
+// its height, the top half is laid out first and then each bottom subtree after
+// it, recursively. Every run of about sqrt(h) levels then sits in a contiguous
+// block, so a lookup touches O(log_B n) cache lines for any line size B, against
+// one line per level for treapFind.
+//
+// Children are found by arithmetic on the BFS index of a node (2i and 2i+1)
+// and per-depth tables (Brodal, Fagerberg and Jacob): a node at depth d is the
+// root of a bottom tree in the recursive cut made above d, whose top tree of
+// top[d] nodes starts at the position of its ancestor at depth topDepth[d] and
+// is followed by bottom trees of bottom[d] nodes each. A descent keeps the
+// positions of the path so far.
+//
+// Slots past the last key are padding holding UINT_MAX; they come last in key
+// order, so they never precede a real key, and a slot's in-order rank (which
+// follows from its BFS index) tells them apart.
+
+// Enough levels for 2^32 keys
+#define TREAP_FROZEN_LEVELS 40
+
+typedef struct treap_frozen {
+    unsigned int *keys;         // The tree, in van Emde Boas order
+#ifdef TREAP_VALUE_TYPE
+    TREAP_VALUE_TYPE *values;   // Parallel to keys
+#endif
+    size_t count;               // Keys frozen
+    size_t slots;               // 2^height - 1, padding included
+    int height;                 // Levels of the tree (0 when empty)
+    size_t top[TREAP_FROZEN_LEVELS], bottom[TREAP_FROZEN_LEVELS];
+    int topDepth[TREAP_FROZEN_LEVELS];
+} treap_frozen_t;
+
+// A position in a frozen snapshot, in key order:
+//     for(treap_frozen_iter_t it = treapFrozenBegin(&f); !treapFrozenIterEnd(it); treapFrozenIterNext(&it))
+//         ... f.keys[it.slot] ...
+typedef struct treap_frozen_iter {
+    const treap_frozen_t *frozen;
+    size_t rank;                // In-order rank; count once past the end
+    size_t slot;                // Array position of the current key
+    size_t index;               // BFS index (1 for the root) of the current key
+    int depth;
+    size_t path[TREAP_FROZEN_LEVELS];   // Array positions from the root down
+} treap_frozen_iter_t;
+
+// Fills in the tables for the (sub)tree of height levels with its root at depth
+static void treapFrozenTables(treap_frozen_t *frozen, int depth, int height){
+    if(height < 2) return;
+    int topHeight = height / 2, bottomHeight = height - topHeight;
+    int cut = depth + topHeight;
+    frozen->topDepth[cut] = depth;
+    frozen->top[cut] = ((size_t)1 << topHeight) - 1;
+    frozen->bottom[cut] = ((size_t)1 << bottomHeight) - 1;
+    treapFrozenTables(frozen, depth, topHeight);
+    treapFrozenTables(frozen, cut, bottomHeight);
+}
+
+// Array position of the node with BFS index index at depth depth (> 0), given
+// the positions of its ancestors
+static inline size_t treapFrozenSlot(const treap_frozen_t *frozen, const size_t *path, size_t index, int depth){
+    return path[frozen->topDepth[depth]] + frozen->top[depth] + (index & frozen->top[depth]) * frozen->bottom[depth];
+}
+
+// In-order rank of the node with BFS index index at depth depth
+static inline size_t treapFrozenRank(const treap_frozen_t *frozen, size_t index, int depth){
+    return ((2 * (index - ((size_t)1 << depth)) + 1) << (frozen->height - 1 - depth)) - 1;
+}
+
+// Moves it down from its current node to the leftmost leaf below child
+static inline void treapFrozenDescendLeft(treap_frozen_iter_t *it, size_t child){
+    const treap_frozen_t *frozen = it->frozen;
+    it->index = child;
+    it->depth++;
+    it->path[it->depth] = treapFrozenSlot(frozen, it->path, it->index, it->depth);
+    while(it->depth + 1 < frozen->height){
+        it->index *= 2;
+        it->depth++;
+        it->path[it->depth] = treapFrozenSlot(frozen, it->path, it->index, it->depth);
+    }
+}
+
+treap_frozen_iter_t treapFrozenBegin(const treap_frozen_t *frozen){
+    treap_frozen_iter_t it;
+    it.frozen = frozen;
+    it.rank = 0;
+    it.index = 1;
+    it.depth = 0;
+    it.path[0] = 0;
+    if(frozen->height > 1) treapFrozenDescendLeft(&it, 2);
+    it.slot = it.path[it.depth];
+    return it;
+}
+
+static inline int treapFrozenIterEnd(treap_frozen_iter_t it){
+    return it.rank >= it.frozen->count;
+}
+
+static inline void treapFrozenIterNext(treap_frozen_iter_t *it){
+    if(++(it->rank) >= it->frozen->count) return;
+    if(it->depth + 1 < it->frozen->height){
+        treapFrozenDescendLeft(it, 2 * it->index + 1);
+    } else {
+        // Up past the right children, then up once more. There is a next key,
+        // so this stops short of the root.
+        while(it->index & 1){
+            it->index >>= 1;
+            it->depth--;
+        }
+        it->index >>= 1;
+        it->depth--;
+    }
+    it->slot = it->path[it->depth];
+}
+
+// Copies the treap into a new frozen snapshot in O(n); the treap is untouched.
+// frozen must be released with treapFrozenDestroy.
+void treapFreeze(treap_t *treap, treap_frozen_t *frozen){
+    TREAP_READ_LOCK(treap);
+    size_t count = 0;
+    for(treap_iter_t it = treapBegin(treap); !treapIterEnd(it); treapIterNext(&it)) count++;
+    int height = 0;
+    while((((size_t)1 << height) - 1) < count) height++;
+
+    memset(frozen, 0, sizeof(treap_frozen_t));
+    frozen->count = count;
+    frozen->slots = ((size_t)1 << height) - 1;
+    frozen->height = height;
+    treapFrozenTables(frozen, 0, height);
+    frozen->keys = (unsigned int *)malloc((frozen->slots + 1) * sizeof(unsigned int));
+#ifdef TREAP_VALUE_TYPE
+    frozen->values = (TREAP_VALUE_TYPE *)calloc(frozen->slots + 1, sizeof(TREAP_VALUE_TYPE));
+    if(frozen->values == NULL){
+        fprintf(stderr, "treap: out of memory\n");
+        exit(1);
+    }
+#endif
+    if(frozen->keys == NULL){
+        fprintf(stderr, "treap: out of memory\n");
+        exit(1);
+    }
+    memset(frozen->keys, 0xFF, frozen->slots * sizeof(unsigned int));
+
+    // Walk the treap and the complete tree in step
+    treap_iter_t from = treapBegin(treap);
+    for(treap_frozen_iter_t to = treapFrozenBegin(frozen); !treapFrozenIterEnd(to); treapFrozenIterNext(&to)){
+        frozen->keys[to.slot] = from.node->treeKey;
+#ifdef TREAP_VALUE_TYPE
+        frozen->values[to.slot] = from.node->value;
+#endif
+        treapIterNext(&from);
+    }
+    TREAP_UNLOCK(treap);
+}
+
+// Rebuilds a mutable treap from a snapshot in O(n). The treap must be empty;
+// the snapshot is left as it was.
+void treapThaw(const treap_frozen_t *frozen, treap_t *treap){
+    unsigned int *keys = (unsigned int *)malloc((frozen->count + 1) * sizeof(unsigned int));
+    if(keys == NULL){
+        fprintf(stderr, "treap: out of memory\n");
+        exit(1);
+    }
+    size_t n = 0;
+    for(treap_frozen_iter_t it = treapFrozenBegin(frozen); !treapFrozenIterEnd(it); treapFrozenIterNext(&it)){
+        keys[n++] = frozen->keys[it.slot];
+    }
+    TREAP_WRITE_LOCK(treap);
+    treapBuildSorted(treap, keys, n);
+#ifdef TREAP_VALUE_TYPE
+    treap_frozen_iter_t from = treapFrozenBegin(frozen);
+    for(treap_iter_t it = treapBegin(treap); !treapIterEnd(it); treapIterNext(&it)){
+        it.node->value = frozen->values[from.slot];
+        treapFrozenIterNext(&from);
+    }
+#endif
+    TREAP_UNLOCK(treap);
+    free(keys);
+}
+
+void treapFrozenDestroy(treap_frozen_t *frozen){
+    free(frozen->keys);
+#ifdef TREAP_VALUE_TYPE
+    free(frozen->values);
+#endif
+    frozen->keys = NULL;
+    frozen->count = 0;
+    frozen->slots = 0;
+    frozen->height = 0;
+}
+
+// The first key at or above key, as an iterator (at the end if there is none).
+// The descent always runs the full height, keeping the deepest node not below
+// key, so its only branch is the loop's. (The tables are zero below the last
+// level, so the slot computed one past it is harmlessly 0.)
+treap_frozen_iter_t treapFrozenLowerBound(const treap_frozen_t *frozen, unsigned int key){
+    treap_frozen_iter_t it;
+    it.frozen = frozen;
+    it.path[0] = 0;
+    size_t index = 1;
+    int best = -1;
+    for(int depth = 0; depth < frozen->height; depth++){
+        int right = frozen->keys[it.path[depth]] < key;
+        best = right ? best : depth;
+        index = 2 * index + right;
+        it.path[depth + 1] = treapFrozenSlot(frozen, it.path, index, depth + 1);
+    }
+    if(best < 0){
+        it.rank = frozen->count;
+        return it;
+    }
+    it.depth = best;
+    it.index = index >> (frozen->height - best);
+    it.slot = it.path[best];
+    it.rank = treapFrozenRank(frozen, it.index, best);
+    if(it.rank > frozen->count) it.rank = frozen->count;   // Padding
+    return it;
+}
+
+// The slot holding key, or NULL if it was not frozen. The value, if any, is
+// frozen->values[slot - frozen->keys].
+const unsigned int *treapFrozenFind(const treap_frozen_t *frozen, unsigned int key){
+    treap_frozen_iter_t it = treapFrozenLowerBound(frozen, key);
+    if(treapFrozenIterEnd(it) || frozen->keys[it.slot] != key) return NULL;
+    return &(frozen->keys[it.slot]);
+}
+
+
+
+
+
+
+// Eytzinger snapshots: a second frozen form, for hot read paths whose keys only
+// change at epoch boundaries. The keys go into an array in BFS order (the
+// children of slot k are 2k and 2k+1, slot 1 is the root), so a lower bound is
+// a loop with no data-dependent branch. Sixteen keys fill a line, so the four
+// levels below slot k start at slot 16k; fetching that line four levels ahead
+// hides most of the latency of the lower levels (Khuong and Morin). The top of
+// the tree stays cached, which is most of the win over treapFind at these sizes.
+
+typedef struct treap_eytzinger {
+    unsigned int *keys;         // keys[1..count] in BFS order, line-aligned; keys[0] unused
+#ifdef TREAP_VALUE_TYPE
+    TREAP_VALUE_TYPE *values;   // Parallel to keys
+#endif
+    size_t count;
+} treap_eytzinger_t;
+
+// The in-order first slot of the subtree at k (its leftmost)
+static inline size_t treapEytzingerFirst(size_t count, size_t k){
+    if(k > count) return 0;
+    while(2 * k <= count) k *= 2;
+    return k;
+}
+
+// Undoes the trailing right turns of a descent, and the left turn before them,
+// giving the last ancestor the descent went left from (0 if there is none)
+static inline size_t treapEytzingerClimb(size_t k){
+#ifdef __GNUC__
+    return k >> (__builtin_ctzll(~(unsigned long long)k) + 1);
+#else
+    while(k & 1) k >>= 1;
+    return k >> 1;
+#endif
+}
+
+// In-order successor of slot k, or 0 after the last
+static inline size_t treapEytzingerNext(const treap_eytzinger_t *ey, size_t k){
+    if(2 * k + 1 <= ey->count) return treapEytzingerFirst(ey->count, 2 * k + 1);
+    return treapEytzingerClimb(k);
+}
+
+// Builds the array from an in-order walk of the treap, in O(n); the treap is
+// untouched. ey must be released with treapEytzingerDestroy.
+void treapEytzingerBuild(treap_t *treap, treap_eytzinger_t *ey){
+    TREAP_READ_LOCK(treap);
+    size_t count = 0;
+    for(treap_iter_t it = treapBegin(treap); !treapIterEnd(it); treapIterNext(&it)) count++;
+    size_t bytes = ((count + 1) * sizeof(unsigned int) + 63) & ~(size_t)63;
+    ey->count = count;
+    ey->keys = (unsigned int *)aligned_alloc(64, bytes);
+#ifdef TREAP_VALUE_TYPE
+    ey->values = (TREAP_VALUE_TYPE *)malloc((count + 1) * sizeof(TREAP_VALUE_TYPE));
+    if(ey->values == NULL){
+        fprintf(stderr, "treap: out of memory\n");
+        exit(1);
+    }
+#endif
+    if(ey->keys == NULL){
+        fprintf(stderr, "treap: out of memory\n");
+        exit(1);
+    }
+    ey->keys[0] = 0;
+    treap_iter_t it = treapBegin(treap);
+    for(size_t k = treapEytzingerFirst(count, 1); k != 0; k = treapEytzingerNext(ey, k)){
+        ey->keys[k] = it.node->treeKey;
+#ifdef TREAP_VALUE_TYPE
+        ey->values[k] = it.node->value;
+#endif
+        treapIterNext(&it);
+    }
+    TREAP_UNLOCK(treap);
+}
+
+void treapEytzingerDestroy(treap_eytzinger_t *ey){
+    free(ey->keys);
+#ifdef TREAP_VALUE_TYPE
+    free(ey->values);
+#endif
+    ey->keys = NULL;
+    ey->count = 0;
+}
+
+// The slot of the smallest key, or 0 if ey is empty
+size_t treapEytzingerBegin(const treap_eytzinger_t *ey){
+    return treapEytzingerFirst(ey->count, 1);
+}
+
+// The slot of the first key at or above key, or 0 if there is none. Continue a
+// range scan from it with treapEytzingerNext. The prefetch address is formed as
+// an integer: near the bottom, slot 16k lies past the end of the array, and a
+// pointer there would be undefined (prefetching it is harmless).
+size_t treapEytzingerLowerBound(const treap_eytzinger_t *ey, unsigned int key){
+    const unsigned int *keys = ey->keys;
+    size_t k = 1, count = ey->count;
+    while(k <= count){
+        TREAP_PREFETCH((const void *)((uintptr_t)keys + 16 * k * sizeof(unsigned int)));
+        k = 2 * k + (keys[k] < key);
+    }
+    return treapEytzingerClimb(k);
+}
+
+// The slot holding key, or NULL if it is absent. The value, if any, is
+// ey->values[slot - ey->keys].
+const unsigned int *treapEytzingerFind(const treap_eytzinger_t *ey, unsigned int key){
+    size_t k = treapEytzingerLowerBound(ey, key);
+    return (k != 0 && ey->keys[k] == key) ? &(ey->keys[k]) : NULL;
+}
+
+
+
+
+
+
+// Index-based variant: the same algorithms over nodes stored in one contiguous
+// array, linked by 32-bit indices rather than pointers. A node is 20 bytes
+// instead of 32 (16 instead of 24 with TREAP_HASHED_PRIORITY), so more of the
+// tree shares each cache line. Index 0 is a sentinel that plays the part of
+// NULL. Nodes are named by index because growing the array may move it; an
+// index stays valid until its node is released.
+#define ITREAP_NIL 0u
+
+typedef struct itreap_node {
+
+    unsigned int treeKey;
+#ifndef TREAP_HASHED_PRIORITY
+    unsigned int heapKey;
+#endif
+
+    uint32_t L, R, P;               // ITREAP_NIL where the pointer version has NULL
+
+} itreap_node_t;
+
+
+typedef struct itreap {
+
+    itreap_node_t *nodes;           // nodes[0] is the sentinel
+    uint32_t root;
+    uint32_t count;                 // Slots handed out so far, sentinel included
+    uint32_t capacity;
+    uint32_t freeList;              // Released slots, linked through L
+    uint64_t rng;
+
+} itreap_t;
+
+
+void itreapInit(itreap_t *treap){
+    treap->nodes = NULL;
+    treap->root = ITREAP_NIL;
+    treap->count = 1;
+    treap->capacity = 0;
+    treap->freeList = ITREAP_NIL;
+    treap->rng = treapSeedState(((uint64_t)rand() << 32) ^ (uint64_t)(uintptr_t)treap);
+}
+
+void itreapSeed(itreap_t *treap, uint64_t seed){
+    treap->rng = treapSeedState(seed);
+}
+
+void itreapDestroy(itreap_t *treap){
+    free(treap->nodes);
+    treap->nodes = NULL;
+    treap->root = ITREAP_NIL;
+    treap->count = 1;
+    treap->capacity = 0;
+    treap->freeList = ITREAP_NIL;
+}
+
+void itreapRelease(itreap_t *treap, uint32_t node){
+    treap->nodes[node].L = treap->freeList;
+    treap->freeList = node;
+}
+
+static uint32_t itreapNodeAlloc(itreap_t *treap){
+    uint32_t node = treap->freeList;
+    if(node != ITREAP_NIL){
+        treap->freeList = treap->nodes[node].L;
+        return node;
+    }
+    if(treap->count == treap->capacity || treap->nodes == NULL){
+        uint32_t capacity = (treap->capacity < TREAP_SLAB_MIN) ? TREAP_SLAB_MIN : treap->capacity * 2;
+        itreap_node_t *nodes = (itreap_node_t *)realloc(treap->nodes, capacity * sizeof(itreap_node_t));
+        if(nodes == NULL){
+            fprintf(stderr, "itreap: out of memory\n");
+            exit(1);
+        }
+        treap->nodes = nodes;
+        treap->capacity = capacity;
+    }
+    return treap->count++;
+}
+
+
+// As treapRotate
+void itreapRotate(itreap_t *treap, uint32_t root, uint32_t pivot){
+    itreap_node_t *n = treap->nodes;
+    if(n[pivot].treeKey < n[root].treeKey){
+        // Right-rotation
+        if(n[pivot].R != ITREAP_NIL) n[n[pivot].R].P = root;
+        n[root].L = n[pivot].R;
+        n[pivot].R = root;
+    } else {
+        // Left-rotation
+        if(n[pivot].L != ITREAP_NIL) n[n[pivot].L].P = root;
+        n[root].R = n[pivot].L;
+        n[pivot].L = root;
+    }
+    uint32_t parent = n[root].P;
+    n[pivot].P = parent;
+    if(parent == ITREAP_NIL){
+        treap->root = pivot;
+    } else if(n[root].treeKey < n[parent].treeKey){
+        n[parent].L = pivot;
+    } else {
+        n[parent].R = pivot;
+    }
+    n[root].P = pivot;
+}
+
+
+// As treapFind; returns ITREAP_NIL if unfound.
+uint32_t itreapFind(itreap_t *treap, unsigned int key){
+    const itreap_node_t *n = treap->nodes;
+    uint32_t cur = treap->root;
+    while(cur != ITREAP_NIL){
+        if(key < n[cur].treeKey){
+            cur = n[cur].L;
+        } else if (key > n[cur].treeKey){
+            cur = n[cur].R;
+        } else {
+            return cur;
+        }
+    }
+    return ITREAP_NIL;
+}
+
+
+// As treapUsurpingFind
+uint32_t itreapUsurpingFind(itreap_t *treap, unsigned int key){
+    uint32_t cur = itreapFind(treap, key);
+#ifndef TREAP_HASHED_PRIORITY
+    if(cur != ITREAP_NIL && treap->nodes[cur].P != ITREAP_NIL){
+        itreap_node_t *n = treap->nodes;
+        uint32_t parent = n[cur].P;
+        unsigned int tempKey = n[cur].heapKey;
+        n[cur].heapKey = n[parent].heapKey;
+        n[parent].heapKey = tempKey;
+        itreapRotate(treap, parent, cur);
+    }
+#endif
+    return cur;
+}
+
+
+// As treapAppend
+uint32_t itreapAppend(itreap_t *treap, unsigned int key){
+
+    uint32_t cur = treap->root;
+    if(cur != ITREAP_NIL){
+        const itreap_node_t *n = treap->nodes;
+        uint32_t next;
+        while(key != n[cur].treeKey && (next = (key < n[cur].treeKey)?n[cur].L:n[cur].R) != ITREAP_NIL) cur = next;
+        if(key == n[cur].treeKey) return cur;
+    }
+
+#ifdef TREAP_HASHED_PRIORITY
+    unsigned int heapKey = treapHashKey(key);
+#else
+    unsigned int heapKey = treapRandom(&(treap->rng));
+#endif
+
+    // Allocation may move the array, so take the base pointer afterwards
+    uint32_t newNode = itreapNodeAlloc(treap);
+    itreap_node_t *n = treap->nodes;
+    n[newNode].P = cur;
+    n[newNode].L = ITREAP_NIL;
+    n[newNode].R = ITREAP_NIL;
+    n[newNode].treeKey = key;
+#ifndef TREAP_HASHED_PRIORITY
+    n[newNode].heapKey = heapKey;
+#endif
+    if(cur == ITREAP_NIL){
+        treap->root = newNode;
+    } else if(key < n[cur].treeKey){
+        n[cur].L = newNode;
+    } else {
+        n[cur].R = newNode;
+    }
+
+    while(n[newNode].P != ITREAP_NIL && heapKey > TREAP_PRIORITY(n[n[newNode].P])){
+        itreapRotate(treap, n[newNode].P, newNode);
+    }
+    return newNode;
+}
+
+
+// As treapDecouple; the slot stays reserved until itreapRelease
+void itreapDecouple(itreap_t *treap, uint32_t node){
+    itreap_node_t *n = treap->nodes;
+    while(!(n[node].L == ITREAP_NIL || n[node].R == ITREAP_NIL)){
+        if(TREAP_PRIORITY(n[n[node].L]) > TREAP_PRIORITY(n[n[node].R])){
+            itreapRotate(treap, node, n[node].L);
+        } else {
+            itreapRotate(treap, node, n[node].R);
+        }
+    }
+
+    uint32_t parent = n[node].P;
+    uint32_t child = (n[node].R != ITREAP_NIL) ? n[node].R : n[node].L;
+    if(parent == ITREAP_NIL){
+        treap->root = child;
+    } else if(n[node].treeKey < n[parent].treeKey){
+        n[parent].L = child;
+    } else {
+        n[parent].R = child;
+    }
+    if(child != ITREAP_NIL) n[child].P = parent;
+}
+
+
+
+
+
+
+
+
+
+// Persistent variant: a node never changes once it is part of a version, so an
+// insert or erase copies the O(log n) path it touches and returns a new root,
+// leaving the old root a complete version that shares every untouched subtree
+// with the new one. Parent pointers cannot survive this (a shared node has a
+// parent in each version), so everything works top-down from a root.
+//
+// A ptreap_t is a family of versions: it hands out their nodes and frees them
+// all together in ptreapDestroy. One thread at a time may write to a family;
+// any number may read any of its versions meanwhile, needing nothing beyond a
+// safe hand-over of the root pointer itself.
+//
+// A family made with ptreapInitCounted instead reference-counts its nodes, so
+// that versions can be dropped one by one: each root held is a reference, and
+// ptreapClone (O(1)) takes another. Insert and erase then consume the root they
+// are given, and copy only the nodes that some other version still shares,
+// changing the rest in place. Clone, release, insert and erase all count as
+// writes.
+typedef struct ptreap_node {
+
+    unsigned int treeKey;
+    unsigned int heapKey;
+    struct ptreap_node *L, *R;      // Read-only once in a version (unless counted
+                                    // and referenced just once)
+    unsigned int refs;              // Counted families: parents and roots held
+
+} ptreap_node_t;
+
+typedef struct ptreap_slab {
+    struct ptreap_slab *next;
+    size_t count;
+    ptreap_node_t nodes[];
+} ptreap_slab_t;
+
+// A growable list of nodes, stamped with an epoch when used as a ctreap bucket
+typedef struct ptreap_limbo {
+    ptreap_node_t **nodes;
+    size_t count, capacity;
+    uint64_t epoch;
+} ptreap_limbo_t;
+
+typedef struct ptreap {
+
+    ptreap_slab_t *slabs;           // Every slab ever allocated, newest first
+    size_t used, nextSlab;          // As in treap_pool_t
+    ptreap_node_t *freeList;        // Recycled nodes, linked through L
+    uint64_t rng;
+    ptreap_limbo_t *replaced;       // If set, superseded nodes are listed here
+    int counted;                    // Nodes are reference-counted
+
+} ptreap_t;
+
+
+void ptreapInit(ptreap_t *family){
+    family->slabs = NULL;
+    family->used = 0;
+    family->nextSlab = TREAP_SLAB_MIN;
+    family->freeList = NULL;
+    family->rng = treapSeedState(((uint64_t)rand() << 32) ^ (uint64_t)(uintptr_t)family);
+    family->replaced = NULL;
+    family->counted = 0;
+}
+
+void ptreapInitCounted(ptreap_t *family){
+    ptreapInit(family);
+    family->counted = 1;
+}
+
+void ptreapSeed(ptreap_t *family, uint64_t seed){
+    family->rng = treapSeedState(seed);
+}
+
+// Frees every version at once
+void ptreapDestroy(ptreap_t *family){
+    while(family->slabs != NULL){
+        ptreap_slab_t *next = family->slabs->next;
+        free(family->slabs);
+        family->slabs = next;
+    }
+    family->used = 0;
+    family->nextSlab = TREAP_SLAB_MIN;
+    family->freeList = NULL;
+}
+
+
+static ptreap_node_t *ptreapNodeAlloc(ptreap_t *family){
+    ptreap_node_t *node = family->freeList;
+    if(node != NULL){
+        family->freeList = node->L;
+        return node;
+    }
+    if(family->slabs == NULL || family->used == family->slabs->count){
+        size_t count = family->nextSlab;
+        ptreap_slab_t *slab = (ptreap_slab_t *)malloc(sizeof(ptreap_slab_t) + count * sizeof(ptreap_node_t));
+        if(slab == NULL){
+            fprintf(stderr, "ptreap: out of memory\n");
+            exit(1);
+        }
+        slab->count = count;
+        slab->next = family->slabs;
+        family->slabs = slab;
+        family->used = 0;
+        if(count < TREAP_SLAB_MAX) family->nextSlab = count * 2;
+    }
+    return &(family->slabs->nodes[family->used++]);
+}
+
+static void ptreapLimboPush(ptreap_limbo_t *list, ptreap_node_t *node){
+    if(list->count == list->capacity){
+        list->capacity = (list->capacity == 0) ? 64 : list->capacity * 2;
+        list->nodes = (ptreap_node_t **)realloc(list->nodes, list->capacity * sizeof(ptreap_node_t *));
+        if(list->nodes == NULL){
+            fprintf(stderr, "ptreap: out of memory\n");
+            exit(1);
+        }
+    }
+    list->nodes[list->count++] = node;
+}
+
+// Notes that the new version no longer uses node
+static void ptreapSupersede(ptreap_t *family, ptreap_node_t *node){
+    if(family->replaced != NULL) ptreapLimboPush(family->replaced, node);
+}
+
+static inline void ptreapRetain(ptreap_node_t *node){
+    if(node != NULL) node->refs++;
+}
+
+// A node the new version may change, which it uses in place of node: a copy,
+// unless the family is counted and nothing else refers to node
+static ptreap_node_t *ptreapCopy(ptreap_t *family, ptreap_node_t *node){
+    if(family->counted){
+        if(node->refs == 1) return node;
+        // The copy shares node's children, and takes over one reference to it
+        ptreapRetain(node->L);
+        ptreapRetain(node->R);
+        node->refs--;
+    }
+    ptreap_node_t *copy = ptreapNodeAlloc(family);
+    *copy = *node;
+    copy->refs = 1;
+    ptreapSupersede(family, node);
+    return copy;
+}
+
+// The new version drops node but keeps its children, which the caller reads
+// beforehand
+static void ptreapDrop(ptreap_t *family, ptreap_node_t *node){
+    if(!family->counted){
+        ptreapSupersede(family, node);
+    } else if(node->refs == 1){
+        // The references to the children pass to the new version
+        node->L = family->freeList;
+        family->freeList = node;
+    } else {
+        ptreapRetain(node->L);
+        ptreapRetain(node->R);
+        node->refs--;
+    }
+}
+
+// Copying split: the pieces are new nodes
+static void ptreapSplitNodes(ptreap_t *family, ptreap_node_t *cur, unsigned int key, ptreap_node_t **l, ptreap_node_t **r){
+    if(cur == NULL){
+        *l = NULL;
+        *r = NULL;
+        return;
+    }
+    ptreap_node_t *copy = ptreapCopy(family, cur);
+    if(copy->treeKey < key){
+        ptreapSplitNodes(family, copy->R, key, &(copy->R), r);
+        *l = copy;
+    } else {
+        ptreapSplitNodes(family, copy->L, key, l, &(copy->L));
+        *r = copy;
+    }
+}
+
+// Copying join of a and b, every key of a below every key of b
+static ptreap_node_t *ptreapJoinNodes(ptreap_t *family, ptreap_node_t *a, ptreap_node_t *b){
+    if(a == NULL) return b;
+    if(b == NULL) return a;
+    if(a->heapKey > b->heapKey){
+        ptreap_node_t *copy = ptreapCopy(family, a);
+        copy->R = ptreapJoinNodes(family, copy->R, b);
+        return copy;
+    }
+    ptreap_node_t *copy = ptreapCopy(family, b);
+    copy->L = ptreapJoinNodes(family, a, copy->L);
+    return copy;
+}
+
+// The new node goes where its priority puts it, splitting what was there. The
+// key must be absent.
+static ptreap_node_t *ptreapInsertNodes(ptreap_t *family, ptreap_node_t *cur, unsigned int key, unsigned int heapKey){
+    if(cur == NULL || heapKey > cur->heapKey){
+        ptreap_node_t *node = ptreapNodeAlloc(family);
+        node->treeKey = key;
+        node->heapKey = heapKey;
+        node->refs = 1;
+        ptreapSplitNodes(family, cur, key, &(node->L), &(node->R));
+        return node;
+    }
+    ptreap_node_t *copy = ptreapCopy(family, cur);
+    if(key < copy->treeKey){
+        copy->L = ptreapInsertNodes(family, copy->L, key, heapKey);
+    } else {
+        copy->R = ptreapInsertNodes(family, copy->R, key, heapKey);
+    }
+    return copy;
+}
+
+// The key must be present
+static ptreap_node_t *ptreapEraseNodes(ptreap_t *family, ptreap_node_t *cur, unsigned int key){
+    if(key == cur->treeKey){
+        ptreap_node_t *l = cur->L, *r = cur->R;
+        ptreapDrop(family, cur);
+        return ptreapJoinNodes(family, l, r);
+    }
+    ptreap_node_t *copy = ptreapCopy(family, cur);
+    if(key < copy->treeKey){
+        copy->L = ptreapEraseNodes(family, copy->L, key);
+    } else {
+        copy->R = ptreapEraseNodes(family, copy->R, key);
+    }
+    return copy;
+}
+
+
+// Lookups on a version (NULL being the empty one)
+ptreap_node_t *ptreapFind(ptreap_node_t *root, unsigned int key){
+    ptreap_node_t *cur = root;
+    while(cur != NULL && cur->treeKey != key) cur = (key < cur->treeKey) ? cur->L : cur->R;
+    return cur;
+}
+
+// Smallest key >= key (LowerBound) or > key (UpperBound), or NULL. With no
+// parent pointers, an in-order scan steps with UpperBound at O(log n) a step:
+//     for(n = ptreapLowerBound(v, lo); n != NULL; n = ptreapUpperBound(v, n->treeKey))
+ptreap_node_t *ptreapLowerBound(ptreap_node_t *root, unsigned int key){
+    ptreap_node_t *cur = root, *best = NULL;
+    while(cur != NULL){
+        if(cur->treeKey >= key){
+            best = cur;
+            cur = cur->L;
+        } else {
+            cur = cur->R;
+        }
+    }
+    return best;
+}
+
+ptreap_node_t *ptreapUpperBound(ptreap_node_t *root, unsigned int key){
+    ptreap_node_t *cur = root, *best = NULL;
+    while(cur != NULL){
+        if(cur->treeKey > key){
+            best = cur;
+            cur = cur->L;
+        } else {
+            cur = cur->R;
+        }
+    }
+    return best;
+}
+
+// The version with key added, copying O(log n) nodes; root itself if key was
+// already there. root stays a valid version either way, unless the family is
+// counted, in which case root's reference passes to the result.
+ptreap_node_t *ptreapInsert(ptreap_t *family, ptreap_node_t *root, unsigned int key){
+    if(ptreapFind(root, key) != NULL) return root;
+    return ptreapInsertNodes(family, root, key, treapRandom(&(family->rng)));
+}
+
+// The version without key, copying O(log n) nodes; root itself if key was
+// absent. As ptreapInsert for counted families.
+ptreap_node_t *ptreapErase(ptreap_t *family, ptreap_node_t *root, unsigned int key){
+    if(ptreapFind(root, key) == NULL) return root;
+    return ptreapEraseNodes(family, root, key);
+}
+
+// Counted families only. Clone takes another reference to a version in O(1);
+// the two can then be changed independently, each copying shared nodes on first
+// change. Release gives one up, recycling the nodes no version still uses.
+ptreap_node_t *ptreapClone(ptreap_t *family, ptreap_node_t *root){
+    (void)family;
+    ptreapRetain(root);
+    return root;
+}
+
+void ptreapRelease(ptreap_t *family, ptreap_node_t *root){
+    if(root == NULL || --(root->refs) > 0) return;
+    ptreap_node_t *l = root->L, *r = root->R;
+    root->L = family->freeList;
+    family->freeList = root;
+    ptreapRelease(family, l);
+    ptreapRelease(family, r);
+}
+
+
+
+// Concurrent variant with wait-free readers, built on the persistent one: a
+// writer makes the next version (path copying under a writer mutex) and swings
+// the root pointer to it with a single atomic store. A reader loads the root
+// once and searches that version, in a bounded number of steps whatever the
+// writers are doing.
+//
+// Superseded nodes are recycled rather than kept, since only the current version
+// is reachable; until no reader can still be standing on them, they are held
+// back. Readers sit in epoch brackets, and each write's superseded nodes are
+// stamped with the epoch current just after the new root is stored; they are
+// recycled two epochs on (see "Epoch-based reclamation"). Unlike the treap's,
+// retired ctreap nodes stay wholly readable, links included, since readers walk
+// old versions; the buckets are therefore arrays.
+typedef ptreap_node_t ctreap_node_t;
+
+typedef struct ctreap {
+
+    _Atomic(ctreap_node_t *) root;
+
+    // Writer-only state, under writeLock
+    pthread_mutex_t writeLock;
+    ptreap_t family;                // Every node, current or waiting
+    ptreap_limbo_t replaced;        // This write's superseded nodes, still published
+    ptreap_limbo_t limbo[3];        // Retired nodes, by epoch modulo 3
+
+} ctreap_t;
+
+
+void ctreapInit(ctreap_t *treap){
+    atomic_init(&(treap->root), NULL);
+    pthread_mutex_init(&(treap->writeLock), NULL);
+    ptreapInit(&(treap->family));
+    memset(&(treap->replaced), 0, sizeof(treap->replaced));
+    memset(treap->limbo, 0, sizeof(treap->limbo));
+    treap->family.replaced = &(treap->replaced);
+}
+
+// Frees everything; no reader or writer may be active.
+void ctreapDestroy(ctreap_t *treap){
+    ptreapDestroy(&(treap->family));
+    atomic_store(&(treap->root), NULL);
+    for(int b = 0; b < 3; b++) free(treap->limbo[b].nodes);
+    free(treap->replaced.nodes);
+    pthread_mutex_destroy(&(treap->writeLock));
+}
+
+
+// Brackets a read: between the two, nodes reachable from the returned root stay
+// valid. Both are wait-free.
+ctreap_node_t *ctreapReadBegin(ctreap_t *treap){
+    treapEpochEnter();
+    return atomic_load(&(treap->root));
+}
+
+void ctreapReadEnd(ctreap_t *treap){
+    (void)treap;
+    treapEpochExit();
+}
+
+// Wait-free membership test.
+int ctreapFind(ctreap_t *treap, unsigned int key){
+    int found = ptreapFind(ctreapReadBegin(treap), key) != NULL;
+    ctreapReadEnd(treap);
+    return found;
+}
+
+
+static void ctreapRecycle(ctreap_t *treap, ptreap_limbo_t *bucket){
+    for(size_t i = 0; i < bucket->count; i++){
+        bucket->nodes[i]->L = treap->family.freeList;
+        treap->family.freeList = bucket->nodes[i];
+    }
+    bucket->count = 0;
+}
+
+// Publishes a new version, retires the nodes it superseded, and recycles those
+// that no reader can still hold
+static void ctreapPublish(ctreap_t *treap, ctreap_node_t *root){
+    atomic_store(&(treap->root), root);
+    uint64_t epoch = atomic_load(&treapEpochGlobal);
+    ptreap_limbo_t *bucket = &(treap->limbo[epoch % 3]);
+    if(bucket->epoch != epoch){
+        // Left over from three or more epochs ago
+        ctreapRecycle(treap, bucket);
+        bucket->epoch = epoch;
+    }
+    for(size_t i = 0; i < treap->replaced.count; i++) ptreapLimboPush(bucket, treap->replaced.nodes[i]);
+    treap->replaced.count = 0;
+    // A write supersedes O(log n) nodes, batch enough to try advancing every time
+    epoch = treapEpochAdvance();
+    for(int b = 0; b < 3; b++){
+        if(treap->limbo[b].epoch + 2 <= epoch) ctreapRecycle(treap, &(treap->limbo[b]));
+    }
+}
+
+// Adds key; returns 1 if it was new, 0 if already present.
+int ctreapInsert(ctreap_t *treap, unsigned int key){
+    pthread_mutex_lock(&(treap->writeLock));
+    ctreap_node_t *root = atomic_load(&(treap->root));
+    ctreap_node_t *next = ptreapInsert(&(treap->family), root, key);
+    if(next != root) ctreapPublish(treap, next);
+    pthread_mutex_unlock(&(treap->writeLock));
+    return next != root;
+}
+
+// Removes key; returns 1 if it was present. The node is recycled once no reader
+// can observe it.
+int ctreapErase(ctreap_t *treap, unsigned int key){
+    pthread_mutex_lock(&(treap->writeLock));
+    ctreap_node_t *root = atomic_load(&(treap->root));
+    ctreap_node_t *next = ptreapErase(&(treap->family), root, key);
+    if(next != root) ctreapPublish(treap, next);
+    pthread_mutex_unlock(&(treap->writeLock));
+    return next != root;
+}
+
+
+
+
+
+
+
+
+
+// Generic keys. TREAP_DEFINE(name, Key, Value, LESS) expands to a treap keyed by
+// any type Key, ordered by LESS(a, b) (a macro or inline function, so that the
+// comparison is compiled in rather than called through a pointer), with a Value
+// in every node. It has the core's algorithms (rotation-based append and
+// decouple over parent pointers) on nodes from a slab arena, and is named by
+// prefixing name (TREAP_DEFINE_SET leaves out the value):
+//     name_t, name_node_t, nameInit, nameSeed, nameDestroy, nameFind,
+//     nameLowerBound, nameInsert, nameDecouple, nameRelease, nameErase,
+//     nameFirst, nameNext
+// Keys are equal when neither is LESS than the other. The unsigned int treap
+// above keeps its own code, with its build flags, locking and bulk operations;
+// a generic treap is single-threaded. For example:
+//     TREAP_DEFINE(htreap, uint64_t, void *, TREAP_LESS)
+#define TREAP_LESS(a, b) ((a) < (b))
+
+// Fixed-size node allocation for the generic treaps: slabs that double in size
+// as with the core's pool, and a free list threaded through the nodes' first word.
+// Slabs are line-aligned, so nodes whose size divides (or is a multiple of) 64
+// bytes never straddle two lines.
+typedef struct treap_arena_slab {
+    struct treap_arena_slab *next;
+    _Alignas(64) unsigned char nodes[];
+} treap_arena_slab_t;
+
+typedef struct treap_arena {
+    treap_arena_slab_t *slabs;      // Newest first
+    size_t nodeSize, used, count, nextSlab;
+    void *freeList;
+} treap_arena_t;
+
+void treapArenaInit(treap_arena_t *arena, size_t nodeSize){
+    arena->slabs = NULL;
+    arena->nodeSize = nodeSize;
+    arena->used = 0;
+    arena->count = 0;
+    arena->nextSlab = TREAP_SLAB_MIN;
+    arena->freeList = NULL;
+}
+
+void *treapArenaAlloc(treap_arena_t *arena){
+    void *node = arena->freeList;
+    if(node != NULL){
+        arena->freeList = *(void **)node;
+        return node;
+    }
+    if(arena->used == arena->count){
+        size_t bytes = (sizeof(treap_arena_slab_t) + arena->nextSlab * arena->nodeSize + 63) & ~(size_t)63;
+        treap_arena_slab_t *slab = (treap_arena_slab_t *)aligned_alloc(64, bytes);
+        if(slab == NULL){
+            fprintf(stderr, "treap: out of memory\n");
+            exit(1);
+        }
+        slab->next = arena->slabs;
+        arena->slabs = slab;
+        arena->used = 0;
+        arena->count = arena->nextSlab;
+        if(arena->nextSlab < TREAP_SLAB_MAX) arena->nextSlab *= 2;
+    }
+    return arena->slabs->nodes + arena->nodeSize * arena->used++;
+}
+
+void treapArenaFree(treap_arena_t *arena, void *node){
+    *(void **)node = arena->freeList;
+    arena->freeList = node;
+}
+
+void treapArenaDestroy(treap_arena_t *arena){
+    while(arena->slabs != NULL){
+        treap_arena_slab_t *next = arena->slabs->next;
+        free(arena->slabs);
+        arena->slabs = next;
+    }
+    treapArenaInit(arena, arena->nodeSize);
+}
+
+
+#define TREAP_DEFINE(name, Key, Value, LESS) TREAP_DEFINE_NODES(name, Key, Value value;, LESS)
+#define TREAP_DEFINE_SET(name, Key, LESS) TREAP_DEFINE_NODES(name, Key, , LESS)
+
+#define TREAP_DEFINE_NODES(name, Key, VALUE_FIELD, LESS) \
+\
+typedef struct name##_node { \
+    Key key; \
+    unsigned int heapKey; \
+    struct name##_node *L, *R, *P; \
+    VALUE_FIELD \
+} name##_node_t; \
+\
+typedef struct name { \
+    name##_node_t *root; \
+    treap_arena_t arena; \
+    uint64_t rng; \
+} name##_t; \
+\
+static inline void name##Init(name##_t *treap){ \
+    treap->root = NULL; \
+    treapArenaInit(&(treap->arena), sizeof(name##_node_t)); \
+    treap->rng = treapSeedState(((uint64_t)rand() << 32) ^ (uint64_t)(uintptr_t)treap); \
+} \
+\
+static inline void name##Seed(name##_t *treap, uint64_t seed){ \
+    treap->rng = treapSeedState(seed); \
+} \
+\
+/* Frees every node, decoupled ones included */ \
+static inline void name##Destroy(name##_t *treap){ \
+    treapArenaDestroy(&(treap->arena)); \
+    treap->root = NULL; \
+} \
+\
+static inline name##_node_t *name##Find(name##_t *treap, Key key){ \
+    name##_node_t *cur = treap->root; \
+    while(cur != NULL && (LESS(key, cur->key) || LESS(cur->key, key))){ \
+        cur = LESS(key, cur->key) ? cur->L : cur->R; \
+    } \
+    return cur; \
+} \
+\
+/* First node whose key is not below key, or NULL */ \
+static inline name##_node_t *name##LowerBound(name##_t *treap, Key key){ \
+    name##_node_t *cur = treap->root, *best = NULL; \
+    while(cur != NULL){ \
+        if(LESS(cur->key, key)){ \
+            cur = cur->R; \
+        } else { \
+            best = cur; \
+            cur = cur->L; \
+        } \
+    } \
+    return best; \
+} \
+\
+static inline void name##Rotate(name##_t *treap, name##_node_t *root, name##_node_t *pivot){ \
+    if(pivot == root->L){ \
+        if(pivot->R != NULL) pivot->R->P = root; \
+        root->L = pivot->R; \
+        pivot->R = root; \
+    } else { \
+        if(pivot->L != NULL) pivot->L->P = root; \
+        root->R = pivot->L; \
+        pivot->L = root; \
+    } \
+    pivot->P = root->P; \
+    if(root->P == NULL){ \
+        treap->root = pivot; \
+    } else if(root == root->P->L){ \
+        root->P->L = pivot; \
+    } else { \
+        root->P->R = pivot; \
+    } \
+    root->P = pivot; \
+} \
+\
+/* Finds key or adds it, with a zeroed value; *inserted (if not NULL) says which */ \
+static inline name##_node_t *name##Insert(name##_t *treap, Key key, int *inserted){ \
+    name##_node_t *cur = treap->root, *parent = NULL, **inPointer = &(treap->root); \
+    while(cur != NULL){ \
+        if(LESS(key, cur->key)){ \
+            inPointer = &(cur->L); \
+        } else if(LESS(cur->key, key)){ \
+            inPointer = &(cur->R); \
+        } else { \
+            if(inserted != NULL) *inserted = 0; \
+            return cur; \
+        } \
+        parent = cur; \
+        cur = *inPointer; \
+    } \
+    name##_node_t *node = (name##_node_t *)treapArenaAlloc(&(treap->arena)); \
+    memset(node, 0, sizeof(*node)); \
+    node->P = parent; \
+    node->heapKey = treapRandom(&(treap->rng)); \
+    node->key = key; \
+    *inPointer = node; \
+    while(node->P != NULL && node->heapKey > node->P->heapKey) name##Rotate(treap, node->P, node); \
+    if(inserted != NULL) *inserted = 1; \
+    return node; \
+} \
+\
+/* Unlinks node, which stays allocated until name##Release */ \
+static inline void name##Decouple(name##_t *treap, name##_node_t *node){ \
+    while(node->L != NULL && node->R != NULL){ \
+        name##Rotate(treap, node, (node->L->heapKey > node->R->heapKey) ? node->L : node->R); \
+    } \
+    name##_node_t *child = (node->L != NULL) ? node->L : node->R; \
+    if(child != NULL) child->P = node->P; \
+    if(node->P == NULL){ \
+        treap->root = child; \
+    } else if(node == node->P->L){ \
+        node->P->L = child; \
+    } else { \
+        node->P->R = child; \
+    } \
+} \
+\
+static inline void name##Release(name##_t *treap, name##_node_t *node){ \
+    treapArenaFree(&(treap->arena), node); \
+} \
+\
+/* Removes key; returns 1 if it was present */ \
+static inline int name##Erase(name##_t *treap, Key key){ \
+    name##_node_t *node = name##Find(treap, key); \
+    if(node == NULL) return 0; \
+    name##Decouple(treap, node); \
+    name##Release(treap, node); \
+    return 1; \
+} \
+\
+/* In order: for(n = nameFirst(&t); n != NULL; n = nameNext(n)) */ \
+static inline name##_node_t *name##First(name##_t *treap){ \
+    name##_node_t *node = treap->root; \
+    if(node != NULL) while(node->L != NULL) node = node->L; \
+    return node; \
+} \
+\
+static inline name##_node_t *name##Next(name##_node_t *node){ \
+    if(node->R != NULL){ \
+        node = node->R; \
+        while(node->L != NULL) node = node->L; \
+        return node; \
+    } \
+    while(node->P != NULL && node == node->P->R) node = node->P; \
+    return node->P; \
+}
+
+
+
+// Block variant: each node holds a sorted block of up to BTREAP_BLOCK keys, all
+// in one cache line, and the priorities belong to blocks, so the treap balances
+// blocks rather than keys. A node's keys lie between those of its left and right
+// subtrees; a descent compares against a block's first and last keys, and only
+// searches inside the block it stops at, with SIMD compares (AVX2 or SSE2,
+// whichever the build targets, else a loop).
+// A key arriving at a full block splits it, and the upper half is placed as a
+// new block, top-down by split as in TREAP_NO_PARENT. A key between two blocks
+// goes to whichever has room. A block that empties is replaced by the join of
+// its subtrees; blocks are not otherwise merged, so heavy erasing leaves them
+// sparse.
+// There are several times fewer blocks than keys, but the tree over them is
+// still binary: a path loses about log2(keys per block) levels, not a constant
+// factor of them. See benchBlock.
+#define BTREAP_BLOCK 8
+
+typedef struct btreap_node {
+    _Alignas(64) unsigned int keys[BTREAP_BLOCK];   // Ascending; the first count are in use
+    struct btreap_node *L, *R;
+    unsigned int heapKey;
+    unsigned int count;
+} btreap_node_t;
+
+typedef struct btreap {
+    btreap_node_t *root;
+    treap_arena_t arena;
+    uint64_t rng;
+    size_t count;               // Keys held
+} btreap_t;
+
+void btreapInit(btreap_t *treap){
+    treap->root = NULL;
+    treapArenaInit(&(treap->arena), sizeof(btreap_node_t));
+    treap->rng = treapSeedState(((uint64_t)rand() << 32) ^ (uint64_t)(uintptr_t)treap);
+    treap->count = 0;
+}
+
+void btreapSeed(btreap_t *treap, uint64_t seed){
+    treap->rng = treapSeedState(seed);
+}
+
+void btreapDestroy(btreap_t *treap){
+    treapArenaDestroy(&(treap->arena));
+    treap->root = NULL;
+    treap->count = 0;
+}
+
+// Position of key in the node's block, or -1
+static inline int btreapBlockFind(const btreap_node_t *node, unsigned int key){
+    unsigned int mask;
+#if BTREAP_BLOCK == 8 && defined(__AVX2__)
+    __m256i keys = _mm256_load_si256((const __m256i *)node->keys);
+    mask = (unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(keys, _mm256_set1_epi32((int)key))));
+#elif BTREAP_BLOCK == 8 && defined(__SSE2__)
+    __m128i wanted = _mm_set1_epi32((int)key);
+    __m128i lo = _mm_load_si128((const __m128i *)node->keys);
+    __m128i hi = _mm_load_si128((const __m128i *)(node->keys + 4));
+    mask = (unsigned int)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(lo, wanted)))
+         | ((unsigned int)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(hi, wanted))) << 4);
+#else
+    mask = 0;
+    for(unsigned int i = 0; i < BTREAP_BLOCK; i++) mask |= (unsigned int)(node->keys[i] == key) << i;
+#endif
+    mask &= (1u << node->count) - 1;
+    if(mask == 0) return -1;
+#ifdef __GNUC__
+    return __builtin_ctz(mask);
+#else
+    int i = 0;
+    while(!(mask & 1)){
+        mask >>= 1;
+        i++;
+    }
+    return i;
+#endif
+}
+
+// Number of keys in the node's block below key
+static inline unsigned int btreapBlockRank(const btreap_node_t *node, unsigned int key){
+    unsigned int rank = 0;
+    while(rank < node->count && node->keys[rank] < key) rank++;
+    return rank;
+}
+
+// The slot holding key, or NULL if it is absent
+const unsigned int *btreapFind(const btreap_t *treap, unsigned int key){
+    const btreap_node_t *cur = treap->root;
+    while(cur != NULL){
+        if(key < cur->keys[0]){
+            cur = cur->L;
+        } else if(key > cur->keys[cur->count - 1]){
+            cur = cur->R;
+        } else {
+            int i = btreapBlockFind(cur, key);
+            return (i < 0) ? NULL : &(cur->keys[i]);
+        }
+    }
+    return NULL;
+}
+
+static btreap_node_t *btreapNodeAlloc(btreap_t *treap){
+    btreap_node_t *node = (btreap_node_t *)treapArenaAlloc(&(treap->arena));
+    memset(node->keys, 0xFF, sizeof(node->keys));
+    node->L = NULL;
+    node->R = NULL;
+    node->heapKey = treapRandom(&(treap->rng));
+    node->count = 0;
+    return node;
+}
+
+// Links in a new block, whose keys must fall in a gap between existing blocks:
+// down past the blocks that outrank it, then what hangs there is split around it
+static void btreapPlace(btreap_t *treap, btreap_node_t *node){
+    unsigned int key = node->keys[0];
+    btreap_node_t *cur = treap->root, **inPointer = &(treap->root);
+    while(cur != NULL && cur->heapKey >= node->heapKey){
+        inPointer = (key < cur->keys[0]) ? &(cur->L) : &(cur->R);
+        cur = *inPointer;
+    }
+    btreap_node_t **lHook = &(node->L), **rHook = &(node->R);
+    while(cur != NULL){
+        if(cur->keys[0] < key){
+            *lHook = cur;
+            lHook = &(cur->R);
+            cur = cur->R;
+        } else {
+            *rHook = cur;
+            rHook = &(cur->L);
+            cur = cur->L;
+        }
+    }
+    *lHook = NULL;
+    *rHook = NULL;
+    *inPointer = node;
+}
+
+// Merges two subtrees where every key in a is below every key in b
+static btreap_node_t *btreapJoin(btreap_node_t *a, btreap_node_t *b){
+    btreap_node_t *root = NULL, **hook = &root;
+    while(a != NULL && b != NULL){
+        if(a->heapKey > b->heapKey){
+            *hook = a;
+            hook = &(a->R);
+            a = a->R;
+        } else {
+            *hook = b;
+            hook = &(b->L);
+            b = b->L;
+        }
+    }
+    *hook = (a != NULL) ? a : b;
+    return root;
+}
+
+// Adds key; returns 1 if it was new, 0 if it was already present
+int btreapInsert(btreap_t *treap, unsigned int key){
+    btreap_node_t *cur = treap->root, *pred = NULL, *succ = NULL;
+    while(cur != NULL){
+        if(key < cur->keys[0]){
+            succ = cur;
+            cur = cur->L;
+        } else if(key > cur->keys[cur->count - 1]){
+            pred = cur;
+            cur = cur->R;
+        } else {
+            break;
+        }
+    }
+
+    btreap_node_t *home = cur;
+    if(home == NULL){
+        if(pred == NULL && succ == NULL){
+            home = btreapNodeAlloc(treap);
+            home->keys[0] = key;
+            home->count = 1;
+            btreapPlace(treap, home);
+            treap->count++;
+            return 1;
+        }
+        // In the gap between two blocks, which nothing else lies in
+        home = (succ == NULL || (pred != NULL && (pred->count < BTREAP_BLOCK || succ->count == BTREAP_BLOCK))) ? pred : succ;
+    }
+    unsigned int rank = btreapBlockRank(home, key);
+    if(rank < home->count && home->keys[rank] == key) return 0;
+
+    if(home->count < BTREAP_BLOCK){
+        memmove(home->keys + rank + 1, home->keys + rank, (home->count - rank) * sizeof(unsigned int));
+        home->keys[rank] = key;
+        home->count++;
+    } else {
+        // Full: the block keeps the lower half, and the upper half moves out
+        unsigned int merged[BTREAP_BLOCK + 1];
+        memcpy(merged, home->keys, rank * sizeof(unsigned int));
+        merged[rank] = key;
+        memcpy(merged + rank + 1, home->keys + rank, (BTREAP_BLOCK - rank) * sizeof(unsigned int));
+        unsigned int keep = (BTREAP_BLOCK + 2) / 2;
+        btreap_node_t *upper = btreapNodeAlloc(treap);
+        memcpy(upper->keys, merged + keep, (BTREAP_BLOCK + 1 - keep) * sizeof(unsigned int));
+        upper->count = BTREAP_BLOCK + 1 - keep;
+        memcpy(home->keys, merged, keep * sizeof(unsigned int));
+        memset(home->keys + keep, 0xFF, (BTREAP_BLOCK - keep) * sizeof(unsigned int));
+        home->count = keep;
+        btreapPlace(treap, upper);
+    }
+    treap->count++;
+    return 1;
+}
+
+// Removes key; returns 1 if it was present
+int btreapErase(btreap_t *treap, unsigned int key){
+    btreap_node_t *cur = treap->root, **inPointer = &(treap->root);
+    while(cur != NULL){
+        if(key < cur->keys[0]){
+            inPointer = &(cur->L);
+        } else if(key > cur->keys[cur->count - 1]){
+            inPointer = &(cur->R);
+        } else {
+            break;
+        }
+        cur = *inPointer;
+    }
+    if(cur == NULL) return 0;
+    int i = btreapBlockFind(cur, key);
+    if(i < 0) return 0;
+    memmove(cur->keys + i, cur->keys + i + 1, (cur->count - i - 1) * sizeof(unsigned int));
+    cur->count--;
+    treap->count--;
+    if(cur->count == 0){
+        *inPointer = btreapJoin(cur->L, cur->R);
+        treapArenaFree(&(treap->arena), cur);
+    }
+    return 1;
+}
+
+
+
+
+
+
+
+
+
+// Test Drivers
+// These walk the tree iteratively (by parent pointers, or a stack of them) so
+// that badly skewed trees cannot overflow the stack. The walks that need to act before, between
+// and after a node's children track which of those three visits they are on.
+#define WALK_DOWN 0     // Arrived from the parent
+#define WALK_LEFT 1     // Back from the left subtree
+#define WALK_RIGHT 2    // Back from the right subtree
+
+// Without parent pointers the walks keep the path back up in a growable stack
+#ifdef TREAP_NO_PARENT
+typedef struct treap_walk {
+    treap_node_t **path;
+    size_t depth, capacity;
+} treap_walk_t;
+
+static void treapWalkPush(treap_walk_t *walk, treap_node_t *node){
+    if(walk->depth == walk->capacity){
+        walk->capacity = (walk->capacity == 0) ? 64 : walk->capacity * 2;
+        walk->path = (treap_node_t **)realloc(walk->path, walk->capacity * sizeof(treap_node_t *));
+        if(walk->path == NULL){
+            fprintf(stderr, "treap: out of memory\n");
+            exit(1);
+        }
+    }
+    walk->path[walk->depth++] = node;
+}
+
+#define WALK_STATE treap_walk_t walk = {NULL, 0, 0}
+#define WALK_INTO(cur, child) (treapWalkPush(&walk, (cur)), (cur) = (child))
+#define WALK_PARENT(cur) (walk.path[walk.depth - 1])
+#define WALK_OUT(cur) ((cur) = walk.path[--walk.depth])
+#define WALK_DONE free(walk.path)
+#else
+#define WALK_STATE (void)0
+#define WALK_INTO(cur, child) ((cur) = (child))
+#define WALK_PARENT(cur) ((cur)->P)
+#define WALK_OUT(cur) ((cur) = (cur)->P)
+#define WALK_DONE (void)0
+#endif
+
+void printTreapKernel(treap_node_t * node){
+    if(node == NULL){
+        printf(".");
+        return;
+    }
+    treap_node_t *cur = node;
+    int visit = WALK_DOWN;
+    WALK_STATE;
+    while(1){
+        if(visit == WALK_DOWN){
+            printf("  [");
+            if(cur->L != NULL){
+                WALK_INTO(cur, cur->L);
+                continue;
+            }
+            printf(".");
+        }
+        if(visit != WALK_RIGHT){
+            printf("]-%d-[", cur->treeKey);
+            if(cur->R != NULL){
+                WALK_INTO(cur, cur->R);
+                visit = WALK_DOWN;
+                continue;
+            }
+            printf(".");
+        }
+        printf("]  ");
+        if(cur == node) break;
+        visit = (cur == WALK_PARENT(cur)->L) ? WALK_LEFT : WALK_RIGHT;
+        WALK_OUT(cur);
+    }
+    WALK_DONE;
+}
+
+void printTreap(treap_t *treap){
+    printTreapKernel(treap->root);
+    printf("\n");
+}
+
+
+// In-order keys must strictly ascend, and so must each node's children
+void testInOrder(treap_node_t *node, unsigned int *value){
+#ifdef TREAP_NO_PARENT
+    treap_node_t *prev = NULL;
+    for(treap_iter_t it = treapIterFrom(node); !treapIterEnd(it); treapIterNext(&it)){
+        treap_node_t *cur = it.node;
+        if(cur->L != NULL && cur->L->treeKey >= cur->treeKey) *value = 0;
+        if(cur->R != NULL && cur->R->treeKey <= cur->treeKey) *value = 0;
+        if(prev != NULL && prev->treeKey >= cur->treeKey) *value = 0;
+        prev = cur;
+    }
+#else
+    treap_node_t *last = treapLast(node);
+    for(treap_node_t *cur = treapFirst(node); cur != last; cur = treapNext(cur)){
+        if(cur->L != NULL && cur->L->treeKey >= cur->treeKey) *value = 0;
+        if(cur->R != NULL && cur->R->treeKey <= cur->treeKey) *value = 0;
+        if(treapNext(cur)->treeKey <= cur->treeKey) *value = 0;
+    }
+    if(last->L != NULL && last->L->treeKey >= last->treeKey) *value = 0;
+#endif
+}
+
+// Counts NULL parents (1 for a healthy tree: the root). A child whose parent
+// pointer is wrong counts too, and is not walked into, since the walk back up
+// would go astray. Without parent pointers there is only the root to count.
+unsigned int properParentTest(treap_node_t* root){
+    if(root == NULL) return 0;
+#ifdef TREAP_NO_PARENT
+    return 1;
+#else
+    unsigned int count = 0;
+    treap_node_t *cur = root;
+    int visit = WALK_DOWN;
+    while(1){
+        if(visit == WALK_DOWN){
+            if(cur->P == NULL) count++;
+            if(cur->L != NULL){
+                if(cur->L->P == cur){
+                    cur = cur->L;
+                    continue;
+                }
+                count++;
+            }
+        }
+        if(visit != WALK_RIGHT && cur->R != NULL){
+            if(cur->R->P == cur){
+                cur = cur->R;
+                visit = WALK_DOWN;
+                continue;
+            }
+            count++;
+        }
+        if(cur == root) break;
+        visit = (cur == cur->P->L) ? WALK_LEFT : WALK_RIGHT;
+        cur = cur->P;
+    }
+    return count;
+#endif
+}
+
+
+unsigned int countNodes(treap_node_t *root){
+    unsigned int count = 0;
+#ifdef TREAP_NO_PARENT
+    for(treap_iter_t it = treapIterFrom(root); !treapIterEnd(it); treapIterNext(&it)) count++;
+#else
+    treap_node_t *last = treapLast(root);
+    for(treap_node_t *cur = treapFirst(root); cur != NULL; cur = (cur == last) ? NULL : treapNext(cur)) count++;
+#endif
+    return count;
+}
+
+
+// Longest root-to-leaf path, in edges
+int getMaxHeight(treap_node_t* root) {
+    if(root == NULL) return 0;
+    int depth = 0, maxDepth = 0;
+    treap_node_t *cur = root;
+    int visit = WALK_DOWN;
+    WALK_STATE;
+    while(1){
+        if(depth > maxDepth) maxDepth = depth;
+        if(visit == WALK_DOWN && cur->L != NULL){
+            WALK_INTO(cur, cur->L);
+            depth++;
+            continue;
+        }
+        if(visit != WALK_RIGHT && cur->R != NULL){
+            WALK_INTO(cur, cur->R);
+            depth++;
+            visit = WALK_DOWN;
+            continue;
+        }
+        if(cur == root) break;
+        visit = (cur == WALK_PARENT(cur)->L) ? WALK_LEFT : WALK_RIGHT;
+        WALK_OUT(cur);
+        depth--;
+    }
+    WALK_DONE;
+    return maxDepth;
+}
+
+
+// First test; established treap function w/ order maintenance over multiple deletes
+double testOne(unsigned int times){
+    printf("\nRunning %u times!\n", times);
+    treap_t bob;
+    treapInit(&bob);
+    for(unsigned int i = 0; i < times; i++){
         treapAppend(&bob, i); 
     }
-    //printTreap(&bob);
+    //printTreap(&bob);
+
+    unsigned int charlie = 1;
+    testInOrder(bob.root, &charlie);
+    printf("In-order?: %u\n", charlie);
+
+    int maxDepth = getMaxHeight(bob.root);
+    printf("Max Depth: %d\n", maxDepth);
+    double logarithm = log2(times);
+    double factor = ((double)maxDepth) / logarithm;
+    printf("Log Factor: %f\n", factor);
+
+    for(unsigned int i=times/4; i < (3 * times)/4; i++){
+        treap_node_t * bill = treapFind(&bob, i);
+        if( bill != NULL){
+            treapDecouple(&bob, bill);
+            treapRelease(&bob, bill);
+            //printf("Parent Nulls: %u\n", properParentTest(bob.root));
+        } else {
+            printf("Not found!\n");
+            exit(2);
+        }
+    }
+
+    charlie = 1;
+    testInOrder(bob.root, &charlie);
+    printf("Post-deletions: In order? %d\n", charlie);
+
+    printf("Max Depth: %d\n", getMaxHeight(bob.root));
+    treapDestroy(&bob);
+    return factor;
+}
+
+// Second test: assesses locality prioritization
+void testTwo(void){
+    treap_t bob;
+    treapInit(&bob);
+
+    for(unsigned int i = 0; i < 10; i++){
+        treapAppend(&bob, i);
+    }
+    printTreap(&bob);
+
+    for(int i = 0; i < 20; i++){
+        treapUsurpingFind(&bob, 1);
+        treapUsurpingFind(&bob, 8);
+    }
+
+    printTreap(&bob);
+    treapDestroy(&bob);
+}
+
+
+// Wall-clock seconds, for the throughput benchmarks
+double nowSeconds(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+
+// Allocation benchmark: ascending inserts, then delete/reinsert churn over the
+// middle half. Build once plainly and once with -DTREAP_MALLOC_NODES to compare.
+void benchAlloc(void){
+    unsigned int times = 2000000;
+#ifdef TREAP_MALLOC_NODES
+    printf("Node allocation: malloc\n");
+#else
+    printf("Node allocation: slab pool\n");
+#endif
+    treap_t bob;
+    treapInit(&bob);
+
+    double start = nowSeconds();
+    for(unsigned int i = 0; i < times; i++){
+        treapAppend(&bob, i);
+    }
+    double elapsed = nowSeconds() - start;
+    printf("Inserts/sec: %.0f\n", times / elapsed);
+
+    start = nowSeconds();
+    for(int round = 0; round < 4; round++){
+        for(unsigned int i = times/4; i < (3 * times)/4; i++){
+            treap_node_t *bill = treapFind(&bob, i);
+            treapDecouple(&bob, bill);
+            treapRelease(&bob, bill);
+        }
+        for(unsigned int i = times/4; i < (3 * times)/4; i++){
+            treapAppend(&bob, i);
+        }
+    }
+    elapsed = nowSeconds() - start;
+    printf("Churn ops/sec: %.0f\n", (4.0 * times) / elapsed);
+
+    start = nowSeconds();
+    treapDestroy(&bob);
+    printf("Destroy: %f s\n", nowSeconds() - start);
+}
+
+
+// Storage benchmark: the pointer treap against the index treap on identical
+// random key sets; inserts, finds, then deletes of every key.
+void benchIndex(void){
+    unsigned int times = 2000000;
+    unsigned int *keys = (unsigned int *)malloc(times * sizeof(unsigned int));
+    for(unsigned int i = 0; i < times; i++) keys[i] = ((unsigned int)rand() << 16) ^ (unsigned int)rand();
+
+    printf("Node size: pointer %zu bytes, index %zu bytes\n", sizeof(treap_node_t), sizeof(itreap_node_t));
+
+    treap_t bob;
+    treapInit(&bob);
+    double start = nowSeconds();
+    for(unsigned int i = 0; i < times; i++) treapAppend(&bob, keys[i]);
+    double insert = nowSeconds() - start;
+    start = nowSeconds();
+    for(unsigned int i = 0; i < times; i++){
+        if(treapFind(&bob, keys[i]) == NULL){
+            printf("Not found!\n");
+            exit(2);
+        }
+    }
+    double find = nowSeconds() - start;
+    start = nowSeconds();
+    for(unsigned int i = 0; i < times; i++){
+        treap_node_t *bill = treapFind(&bob, keys[i]);
+        if(bill != NULL){
+            treapDecouple(&bob, bill);
+            treapRelease(&bob, bill);
+        }
+    }
+    double erase = nowSeconds() - start;
+    printf("Pointer: %.0f inserts/sec, %.0f finds/sec, %.0f deletes/sec\n", times / insert, times / find, times / erase);
+    treapDestroy(&bob);
+
+    itreap_t alice;
+    itreapInit(&alice);
+    start = nowSeconds();
+    for(unsigned int i = 0; i < times; i++) itreapAppend(&alice, keys[i]);
+    insert = nowSeconds() - start;
+    start = nowSeconds();
+    for(unsigned int i = 0; i < times; i++){
+        if(itreapFind(&alice, keys[i]) == ITREAP_NIL){
+            printf("Not found!\n");
+            exit(2);
+        }
+    }
+    find = nowSeconds() - start;
+    start = nowSeconds();
+    for(unsigned int i = 0; i < times; i++){
+        uint32_t bill = itreapFind(&alice, keys[i]);
+        if(bill != ITREAP_NIL){
+            itreapDecouple(&alice, bill);
+            itreapRelease(&alice, bill);
+        }
+    }
+    erase = nowSeconds() - start;
+    printf("Index:   %.0f inserts/sec, %.0f finds/sec, %.0f deletes/sec\n", times / insert, times / find, times / erase);
+    if(alice.root != ITREAP_NIL){
+        printf("Index treap not empty after deletes!\n");
+        exit(2);
+    }
+    itreapDestroy(&alice);
+
+    free(keys);
+}
+
+
+// Per-thread body of benchPriority: fill a private treap with distinct keys
+typedef struct bench_insert_job {
+    unsigned int times;
+    unsigned int seed;
+} bench_insert_job_t;
+
+static void *benchInsertWorker(void *arg){
+    bench_insert_job_t *job = (bench_insert_job_t *)arg;
+    treap_t bob;
+    treapInit(&bob);
+    treapSeed(&bob, job->seed);
+    for(unsigned int i = 0; i < job->times; i++){
+        // Multiplicative hashing permutes the keys without touching any generator
+        treapAppend(&bob, (i + job->seed * job->times) * 2654435761u);
+    }
+    treapDestroy(&bob);
+    return NULL;
+}
+
+// Priority generator benchmark: aggregate insert throughput with one thread and
+// with one thread per core, each thread on its own treap. Build once plainly and
+// once with -DTREAP_LIBC_RAND to see the shared rand() lock.
+void benchPriority(void){
+    unsigned int times = 1000000;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int counts[] = {1, (cores < 4) ? 4 : (int)cores};
+#ifdef TREAP_LIBC_RAND
+    printf("Priorities: global rand()\n");
+#else
+    printf("Priorities: per-treap xorshift64*\n");
+#endif
+    for(int c = 0; c < 2; c++){
+        int threads = counts[c];
+        pthread_t *ids = (pthread_t *)malloc(threads * sizeof(pthread_t));
+        bench_insert_job_t *jobs = (bench_insert_job_t *)malloc(threads * sizeof(bench_insert_job_t));
+        double start = nowSeconds();
+        for(int t = 0; t < threads; t++){
+            jobs[t].times = times;
+            jobs[t].seed = (unsigned int)t;
+            pthread_create(&ids[t], NULL, benchInsertWorker, &jobs[t]);
+        }
+        for(int t = 0; t < threads; t++) pthread_join(ids[t], NULL);
+        double elapsed = nowSeconds() - start;
+        printf("%d thread(s): %.0f inserts/sec\n", threads, ((double)times * threads) / elapsed);
+        free(ids);
+        free(jobs);
+    }
+}
+
+
+#ifdef TREAP_HASHED_PRIORITY
+int sameShape(treap_node_t *a, treap_node_t *b){
+    if(a == NULL || b == NULL) return a == b;
+    return a->treeKey == b->treeKey && sameShape(a->L, b->L) && sameShape(a->R, b->R);
+}
+
+// Hashed priorities: the same key set must give the same shape whatever the
+// insertion order or seed, even after deletions
+void testShape(void){
+    unsigned int times = 100000;
+    printf("Node size: pointer %zu bytes, index %zu bytes\n", sizeof(treap_node_t), sizeof(itreap_node_t));
+    treap_t bob, alice;
+    treapInit(&bob);
+    treapInit(&alice);
+    treapSeed(&alice, 12345);
+    for(unsigned int i = 0; i < times; i++){
+        treapAppend(&bob, i);
+        treapAppend(&alice, times - 1 - i);
+    }
+    printf("Same shape: %d\n", sameShape(bob.root, alice.root));
+    for(unsigned int i = 0; i < times; i += 3){
+        treap_node_t *bill = treapFind(&alice, i);
+        treapDecouple(&alice, bill);
+        treapRelease(&alice, bill);
+    }
+    treap_t carol;
+    treapInit(&carol);
+    for(unsigned int i = 0; i < times; i++){
+        if(i % 3 != 0) treapAppend(&carol, i);
+    }
+    printf("Same shape after deletions: %d\n", sameShape(carol.root, alice.root));
+    printf("Max Depth: %d\n", getMaxHeight(bob.root));
+    treapDestroy(&bob);
+    treapDestroy(&alice);
+    treapDestroy(&carol);
+}
+#endif
+
+
+// Range test: testOne's middle-half deletion loop against one treapEraseRange,
+// plus a split/join and extract/join round trip checked for order and parents
+void benchRange(void){
+    unsigned int times = 1000000;
+    treap_t bob;
+    treapInit(&bob);
+    for(unsigned int i = 0; i < times; i++) treapAppend(&bob, i);
+    double start = nowSeconds();
+    for(unsigned int i = times/4; i < (3 * times)/4; i++){
+        treap_node_t *bill = treapFind(&bob, i);
+        treapDecouple(&bob, bill);
+        treapRelease(&bob, bill);
+    }
+    printf("Find+decouple loop: %f s\n", nowSeconds() - start);
+    treapDestroy(&bob);
+    treapInit(&bob);
+
+    for(unsigned int i = 0; i < times; i++) treapAppend(&bob, i);
+    start = nowSeconds();
+    treapEraseRange(&bob, times/4, (3 * times)/4);
+    printf("treapEraseRange: %f s\n", nowSeconds() - start);
+    unsigned int charlie = 1;
+    testInOrder(bob.root, &charlie);
+    printf("In order? %u, Parent Nulls: %u, Found %d %d %d\n", charlie, properParentTest(bob.root),
+           treapFind(&bob, times/4 - 1) != NULL, treapFind(&bob, times/4) != NULL, treapFind(&bob, (3 * times)/4) != NULL);
+
+    treap_t left, right, middle;
+    treapInit(&left);
+    treapInit(&right);
+    treapInit(&middle);
+    treapSplit(&bob, times/8, &left, &right);
+    treapJoin(&left, &right);
+    treapAppend(&left, times/2);
+    treapExtractRange(&left, times/8, (7 * times)/8, &middle);
+    treapSplit(&left, times/8, &left, &right);
+    treapJoin(&left, &middle);
+    treapJoin(&left, &right);
+    charlie = 1;
+    testInOrder(left.root, &charlie);
+    printf("Round trip in order? %u, Parent Nulls: %u, Max Depth: %d\n", charlie, properParentTest(left.root), getMaxHeight(left.root));
+
+    treapDestroy(&bob);
+    treapDestroy(&left);
+    treapDestroy(&right);
+    treapDestroy(&middle);
+}
+
+
+// Bulk build benchmark: ascending appends against treapBuildSorted
+void benchBuild(void){
+    unsigned int times = 4000000;
+    unsigned int *keys = (unsigned int *)malloc(times * sizeof(unsigned int));
+    for(unsigned int i = 0; i < times; i++) keys[i] = i * 2;
+
+    treap_t bob;
+    treapInit(&bob);
+    double start = nowSeconds();
+    for(unsigned int i = 0; i < times; i++) treapAppend(&bob, keys[i]);
+    double elapsed = nowSeconds() - start;
+    printf("Appends: %f s, Max Depth: %d\n", elapsed, getMaxHeight(bob.root));
+    treapDestroy(&bob);
+    treapInit(&bob);
+
+    start = nowSeconds();
+    treapBuildSorted(&bob, keys, times);
+    elapsed = nowSeconds() - start;
+    printf("treapBuildSorted: %f s, Max Depth: %d\n", elapsed, getMaxHeight(bob.root));
+    unsigned int charlie = 1;
+    testInOrder(bob.root, &charlie);
+    printf("In order? %u, Parent Nulls: %u, Found %d %d\n", charlie, properParentTest(bob.root),
+           treapFind(&bob, 2 * (times - 1)) != NULL, treapFind(&bob, 3) != NULL);
+    treapDestroy(&bob);
+    free(keys);
+}
+
+
+// Builds a treap over a random subset of [0, range), marking members in flags
+static void randomSet(treap_t *treap, unsigned int count, unsigned int range, unsigned char *flags){
+    treapInit(treap);
+    memset(flags, 0, range);
+    for(unsigned int i = 0; i < count; i++){
+        unsigned int key = (((unsigned int)rand() << 16) ^ (unsigned int)rand()) % range;
+        flags[key] = 1;
+        treapAppend(treap, key);
+    }
+}
+
+// Checks a set operation's result against the expected membership flags
+static void checkSet(const char *name, treap_t *treap, const unsigned char *flags, unsigned int range, double elapsed){
+    unsigned int charlie = 1, expected = 0, missing = 0;
+    if(treap->root != NULL) testInOrder(treap->root, &charlie);
+    for(unsigned int key = 0; key < range; key++){
+        if(flags[key]){
+            expected++;
+            if(treapFind(treap, key) == NULL) missing++;
+        }
+    }
+    printf("%s: %f s, in order? %u, parent nulls: %u, size %u (expected %u, missing %u)\n", name, elapsed, charlie,
+           properParentTest(treap->root), countNodes(treap->root), expected, missing);
+}
+
+// Set operation test: union, intersection and difference of two random sets,
+// on one thread and on a worker pool, against key-by-key treapFind
+void benchSetOps(void){
+    unsigned int times = 1000000, range = 4 * times;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned char *aFlags = (unsigned char *)malloc(range), *bFlags = (unsigned char *)malloc(range);
+    unsigned char *expect = (unsigned char *)malloc(range);
+    treap_workers_t workers;
+    treapWorkersStart(&workers, (cores < 2) ? 1 : (int)cores - 1);
+
+    for(int parallel = 0; parallel < 2; parallel++){
+        treap_workers_t *pool = parallel ? &workers : NULL;
+        printf("%s\n", parallel ? "Worker pool:" : "Single thread:");
+        for(int op = 0; op < 3; op++){
+            treap_t a, b;
+            srand(op + 1);
+            randomSet(&a, times, range, aFlags);
+            randomSet(&b, times, range, bFlags);
+            for(unsigned int key = 0; key < range; key++){
+                expect[key] = (op == 0) ? (aFlags[key] | bFlags[key]) :
+                              (op == 1) ? (aFlags[key] & bFlags[key]) : (aFlags[key] & !bFlags[key]);
+            }
+            // A sample of keys in both sets, spread over the range, whose nodes
+            // in a must come through a union or intersection unchanged
+            unsigned int sampleKeys[64];
+            treap_node_t *sampleNodes[64];
+            int samples = 0;
+            for(int i = 0; i < 64; i++){
+                for(unsigned int key = i * (range / 64); key < (i + 1) * (range / 64); key++){
+                    if(aFlags[key] && bFlags[key]){
+                        sampleKeys[samples] = key;
+                        sampleNodes[samples++] = treapFind(&a, key);
+                        break;
+                    }
+                }
+            }
+            double start = nowSeconds();
+            if(op == 0) treapUnion(&a, &b, pool);
+            if(op == 1) treapIntersect(&a, &b, pool);
+            if(op == 2) treapDifference(&a, &b, pool);
+            double elapsed = nowSeconds() - start;
+            checkSet((op == 0) ? "Union" : (op == 1) ? "Intersect" : "Difference", &a, expect, range, elapsed);
+            if(op != 2){
+                int replaced = 0;
+                for(int i = 0; i < samples; i++) replaced += treapFind(&a, sampleKeys[i]) != sampleNodes[i];
+                printf("  a's nodes for shared keys: %d of %d replaced (expected 0)\n", replaced, samples);
+            }
+            treapDestroy(&a);
+            treapDestroy(&b);
+        }
+    }
+
+    // The old way: probe one set with every key of the other
+    treap_t a, b;
+    srand(2);
+    randomSet(&a, times, range, aFlags);
+    randomSet(&b, times, range, bFlags);
+    double start = nowSeconds();
+    unsigned int common = 0;
+    for(unsigned int key = 0; key < range; key++){
+        if(bFlags[key] && treapFind(&a, key) != NULL) common++;
+    }
+    printf("Key-by-key intersect: %f s, size %u\n", nowSeconds() - start, common);
+    treapDestroy(&a);
+    treapDestroy(&b);
+
+#ifndef TREAP_MALLOC_NODES
+    // Joining a treap that shares its pool into one with a pool of its own copies
+    // the nodes over; the sharer must then give its retired nodes back to the
+    // shared pool and let go of it, leaving the owner its only user (run under
+    // LeakSanitizer to see the pool freed at the end)
+    treap_t owner, sharer, other;
+    treapInit(&owner);
+    for(unsigned int key = 2000; key < 3000; key++) treapAppend(&owner, key);
+    treapInitShared(&sharer, &owner);
+    for(unsigned int key = 1000; key < 2000; key++) treapAppend(&sharer, key);
+    treap_node_t *gone = treapFind(&sharer, 1500);
+    treapDecouple(&sharer, gone);
+    treapRetire(&sharer, gone);
+    treapInit(&other);
+    for(unsigned int key = 0; key < 1000; key++) treapAppend(&other, key);
+    treap_pool_t *shared = owner.pool;
+    treapJoin(&other, &sharer);
+    unsigned int limbo = 0;
+    for(int i = 0; i < 3; i++) limbo += sharer.limbo[i].nodes != NULL;
+    printf("Join from a shared pool: size %u, shared pool users %u (expected 1), retired left %u\n",
+           countNodes(other.root), shared->refs, limbo);
+    treapDestroy(&sharer);
+    treapDestroy(&other);
+    treapDestroy(&owner);
+#endif
+
+    treapWorkersStop(&workers);
+    free(aFlags);
+    free(bFlags);
+    free(expect);
+}
+
+
+// Batch test: sorted batches of random keys applied with treapInsertBatch and
+// treapEraseBatch, on one thread and on a worker pool, against one treapAppend
+// (or find, decouple and release) per key
+void benchBatch(void){
+    unsigned int times = 1000000, range = 4 * times;
+    unsigned int sizes[] = {10000, 100000, 1000000};
+    const char *methods[] = {"one at a time", "batch", "batch on workers"};
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned char *aFlags = (unsigned char *)malloc(range), *bFlags = (unsigned char *)malloc(range);
+    unsigned char *expect = (unsigned char *)malloc(range);
+    unsigned int *keys = (unsigned int *)malloc(times * sizeof(unsigned int));
+    treap_workers_t workers;
+    treapWorkersStart(&workers, (cores < 2) ? 1 : (int)cores - 1);
+
+    for(int s = 0; s < 3; s++){
+        for(int erase = 0; erase < 2; erase++){
+            for(int method = 0; method < 3; method++){
+                treap_t a;
+                srand(s + 1);
+                randomSet(&a, times, range, aFlags);
+                // Batch keys come out sorted by scanning their flags
+                memset(bFlags, 0, range);
+                for(unsigned int i = 0; i < sizes[s]; i++){
+                    bFlags[(((unsigned int)rand() << 16) ^ (unsigned int)rand()) % range] = 1;
+                }
+                size_t n = 0;
+                for(unsigned int key = 0; key < range; key++){
+                    if(bFlags[key]) keys[n++] = key;
+                    expect[key] = erase ? (aFlags[key] & !bFlags[key]) : (aFlags[key] | bFlags[key]);
+                }
+
+                // A sample of keys already in a that the batch inserts again:
+                // their nodes, and the values stored on them, must survive
+                unsigned int sampleKeys[64];
+                treap_node_t *sampleNodes[64];
+                int samples = 0;
+                for(int i = 0; i < 64 && !erase; i++){
+                    for(unsigned int key = i * (range / 64); key < (i + 1) * (range / 64); key++){
+                        if(aFlags[key] && bFlags[key]){
+                            sampleKeys[samples] = key;
+                            sampleNodes[samples] = treapFind(&a, key);
+#ifdef TREAP_VALUE_TYPE
+                            sampleNodes[samples]->value = (TREAP_VALUE_TYPE)(uintptr_t)(key + 1);
+#endif
+                            samples++;
+                            break;
+                        }
+                    }
+                }
+
+                double start = nowSeconds();
+                if(method == 0){
+                    for(size_t i = 0; i < n; i++){
+                        if(!erase){
+                            treapAppend(&a, keys[i]);
+                        } else {
+                            treap_node_t *bill = treapFind(&a, keys[i]);
+                            if(bill != NULL){
+                                treapDecouple(&a, bill);
+                                treapRelease(&a, bill);
+                            }
+                        }
+                    }
+                } else {
+                    treap_workers_t *pool = (method == 2) ? &workers : NULL;
+                    if(erase){
+                        treapEraseBatch(&a, keys, n, pool);
+                    } else {
+                        treapInsertBatch(&a, keys, n, pool);
+                    }
+                }
+                double elapsed = nowSeconds() - start;
+                char name[64];
+                snprintf(name, sizeof(name), "%s %zu, %s", erase ? "Erase" : "Insert", n, methods[method]);
+                checkSet(name, &a, expect, range, elapsed);
+                if(!erase){
+                    int replaced = 0;
+                    for(int i = 0; i < samples; i++){
+                        treap_node_t *node = treapFind(&a, sampleKeys[i]);
+                        if(node != sampleNodes[i]){
+                            replaced++;
+#ifdef TREAP_VALUE_TYPE
+                        } else if((uintptr_t)node->value != sampleKeys[i] + 1){
+                            replaced++;
+#endif
+                        }
+                    }
+                    printf("  Existing keys' nodes: %d of %d replaced or changed (expected 0)\n", replaced, samples);
+                }
+                treapDestroy(&a);
+            }
+        }
+    }
+
+    treapWorkersStop(&workers);
+    free(aFlags);
+    free(bFlags);
+    free(expect);
+    free(keys);
+}
+
+
+#ifdef TREAP_SIZES
+// k-th smallest by in-order walk, as answered before size augmentation
+static treap_node_t *selectByWalk(treap_node_t *node, unsigned int *k){
+    if(node == NULL) return NULL;
+    treap_node_t *found = selectByWalk(node->L, k);
+    if(found != NULL) return found;
+    if((*k)-- == 0) return node;
+    return selectByWalk(node->R, k);
+}
+
+// Order statistics test: treapSelect/treapRank against the in-order walk,
+// checked through appends, deletes, range erases and set operations
+void benchRank(void){
+    unsigned int times = 1000000, queries = 200;
+    treap_t bob, alice;
+    treapInit(&bob);
+    treapInit(&alice);
+    for(unsigned int i = 0; i < times; i++) treapAppend(&bob, 2 * i);
+    for(unsigned int i = 0; i < times; i += 2){
+        treap_node_t *bill = treapFind(&bob, 2 * i);
+        treapDecouple(&bob, bill);
+        treapRelease(&bob, bill);
+    }
+    treapEraseRange(&bob, times / 2, times);
+    unsigned int *keys = (unsigned int *)malloc(times * sizeof(unsigned int));
+    for(unsigned int i = 0; i < times; i++) keys[i] = 2 * i + 1;
+    treapBuildSorted(&alice, keys, times);
+    treapUnion(&bob, &alice, NULL);
+    unsigned int n = countNodes(bob.root);
+    printf("Size: %u (root says %u)\n", n, TREAP_SIZE(bob.root));
+
+    double start = nowSeconds();
+    unsigned long long walkSum = 0;
+    for(unsigned int q = 0; q < queries; q++){
+        unsigned int k = (unsigned int)(((unsigned long long)q * n) / queries);
+        walkSum += selectByWalk(bob.root, &k)->treeKey;
+    }
+    double walk = nowSeconds() - start;
+
+    start = nowSeconds();
+    unsigned long long selectSum = 0;
+    unsigned int wrongRank = 0;
+    for(unsigned int q = 0; q < queries; q++){
+        unsigned int k = (unsigned int)(((unsigned long long)q * n) / queries);
+        treap_node_t *node = treapSelect(&bob, k);
+        selectSum += node->treeKey;
+        if(treapRank(&bob, node->treeKey) != k) wrongRank++;
+    }
+    double select = nowSeconds() - start;
+    printf("In-order walk: %f s, treapSelect+treapRank: %f s\n", walk, select);
+    printf("Answers agree? %d, rank mismatches: %u\n", walkSum == selectSum, wrongRank);
+    free(keys);
+    treapDestroy(&bob);
+    treapDestroy(&alice);
+}
+#endif
+
+
+#ifndef TREAP_NO_PARENT
+// Navigation test: a range scan by re-descending for every key against one
+// treapLowerBound followed by treapNext steps, plus a reverse walk with treapPrev
+void benchNavigate(void){
+    unsigned int times = 1000000, scans = 100, width = 10000;
+    treap_t bob;
+    treapInit(&bob);
+    for(unsigned int i = 0; i < times; i++) treapAppend(&bob, 3 * i);
+
+    double start = nowSeconds();
+    unsigned long long descendSum = 0;
+    for(unsigned int s = 0; s < scans; s++){
+        unsigned int key = (unsigned int)(((unsigned long long)s * 3 * times) / scans);
+        treap_node_t *cur = treapLowerBound(&bob, key);
+        for(unsigned int i = 0; i < width && cur != NULL; i++){
+            descendSum += cur->treeKey;
+            cur = treapUpperBound(&bob, cur->treeKey);
+        }
+    }
+    double descend = nowSeconds() - start;
+
+    start = nowSeconds();
+    unsigned long long stepSum = 0;
+    for(unsigned int s = 0; s < scans; s++){
+        unsigned int key = (unsigned int)(((unsigned long long)s * 3 * times) / scans);
+        treap_node_t *cur = treapLowerBound(&bob, key);
+        for(unsigned int i = 0; i < width && cur != NULL; i++){
+            stepSum += cur->treeKey;
+            cur = treapNext(cur);
+        }
+    }
+    double step = nowSeconds() - start;
+    printf("Re-descending scan: %f s, treapNext scan: %f s, agree? %d\n", descend, step, descendSum == stepSum);
+
+    unsigned int count = 0, ordered = treapUpperBound(&bob, 3 * (times - 1)) == NULL;
+    for(treap_node_t *cur = treapLowerBound(&bob, 3 * (times - 1)); cur != NULL; cur = treapPrev(cur)){
+        treap_node_t *prev = treapPrev(cur);
+        if(prev != NULL && (prev->treeKey >= cur->treeKey || treapNext(prev) != cur)) ordered = 0;
+        count++;
+    }
+    printf("Reverse walk: %u nodes, consistent? %u, bounds %u %u\n", count, ordered,
+           treapLowerBound(&bob, 4)->treeKey, treapUpperBound(&bob, 6)->treeKey);
+    treapDestroy(&bob);
+}
+#endif
+
+
+// The recursive forms the test drivers used to take, kept for comparison
+static unsigned long long sumRecursive(treap_node_t *node){
+    return (node == NULL) ? 0 : sumRecursive(node->L) + node->treeKey + sumRecursive(node->R);
+}
+
+static int heightRecursive(treap_node_t *root){
+    int left = ((root->L == NULL) ? 0 :  1 + heightRecursive(root->L));
+    int right = ((root->R == NULL) ? 0 : 1 + heightRecursive(root->R));
+    return ((right > left) ? right : left);
+}
+
+// Traversal benchmark: full-tree scans by recursion and by iterator, and both
+// height computations, on a random tree and on a usurp-skewed one
+void benchTraverse(void){
+    unsigned int times = 2000000, rounds = 5;
+    treap_t bob;
+    treapInit(&bob);
+    for(unsigned int i = 0; i < times; i++) treapAppend(&bob, ((unsigned int)rand() << 16) ^ (unsigned int)rand());
+
+    for(int skewed = 0; skewed < 2; skewed++){
+        if(skewed){
+            // Repeatedly promoting keys in ascending order drags the tree into a
+            // spine. The promotions reshape the tree, so each step looks up the
+            // next key afresh (a stack iterator would be left stale)
+            for(treap_node_t *node = treapLowerBound(&bob, 0); node != NULL; ){
+                unsigned int key = node->treeKey;
+                for(int i = 0; i < 8; i++) treapUsurpingFind(&bob, key);
+                node = (key == UINT32_MAX) ? NULL : treapLowerBound(&bob, key + 1);
+            }
+        }
+        int height = getMaxHeight(bob.root);
+        printf("%s tree, Max Depth: %d\n", skewed ? "Usurp-skewed" : "Random", height);
+
+        double start = nowSeconds();
+        unsigned long long recursiveSum = 0;
+        for(unsigned int r = 0; r < rounds; r++) recursiveSum += sumRecursive(bob.root);
+        double recursive = nowSeconds() - start;
+
+        start = nowSeconds();
+        unsigned long long iterSum = 0;
+        for(unsigned int r = 0; r < rounds; r++){
+            for(treap_iter_t it = treapBegin(&bob); !treapIterEnd(it); treapIterNext(&it)) iterSum += it.node->treeKey;
+        }
+        double iterative = nowSeconds() - start;
+        printf("Scan nodes/sec: recursive %.0f, iterator %.0f, agree? %d\n",
+               (double)times * rounds / recursive, (double)times * rounds / iterative, recursiveSum == iterSum);
+
+        // Deep enough spines would overflow the stack; only recurse when it is safe
+        if(height < 100000){
+            start = nowSeconds();
+            int recursiveHeight = heightRecursive(bob.root);
+            recursive = nowSeconds() - start;
+            start = nowSeconds();
+            height = getMaxHeight(bob.root);
+            iterative = nowSeconds() - start;
+            printf("Height: recursive %f s, iterative %f s, agree? %d\n", recursive, iterative, recursiveHeight == height);
+        }
+    }
+    treapDestroy(&bob);
+}
+
+
+#ifdef TREAP_THREADSAFE
+// Per-thread body of benchLocking: a mix of finds and writes on a shared treap,
+// where a write appends a random key or removes one (find and decouple under a
+// single exclusive lock, so no other writer can get in between)
+typedef struct bench_mix_job {
+    treap_t *treap;
+    unsigned int ops, range, writePercent;
+    uint64_t rng;
+} bench_mix_job_t;
+
+static void *benchMixWorker(void *arg){
+    bench_mix_job_t *job = (bench_mix_job_t *)arg;
+    for(unsigned int i = 0; i < job->ops; i++){
+        unsigned int key = treapRandom(&(job->rng)) % job->range;
+        unsigned int roll = treapRandom(&(job->rng)) % 100;
+        if(roll >= job->writePercent){
+            treapFind(job->treap, key);
+        } else if(roll & 1){
+            treapAppend(job->treap, key);
+        } else {
+            treapLockExclusive(job->treap);
+            treap_node_t *bill = treapFindUnlocked(job->treap, key);
+            if(bill != NULL){
+                treapDecoupleUnlocked(job->treap, bill);
+                treapRelease(job->treap, bill);
+            }
+            treapUnlock(job->treap);
+        }
+    }
+    return NULL;
+}
+
+// Locking benchmark: aggregate throughput of 100/0, 95/5 and 50/50 read/write
+// mixes on one shared treap, across thread counts
+void benchLocking(void){
+    unsigned int times = 1000000, ops = 500000;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int maxThreads = (cores < 4) ? 4 : (int)cores;
+    unsigned int writes[] = {0, 5, 50};
+    for(int w = 0; w < 3; w++){
+        for(int threads = 1; threads <= maxThreads; threads *= 2){
+            treap_t bob;
+            treapInit(&bob);
+            for(unsigned int i = 0; i < times; i++) treapAppend(&bob, 2 * i);
+            pthread_t *ids = (pthread_t *)malloc(threads * sizeof(pthread_t));
+            bench_mix_job_t *jobs = (bench_mix_job_t *)malloc(threads * sizeof(bench_mix_job_t));
+            double start = nowSeconds();
+            for(int t = 0; t < threads; t++){
+                jobs[t].treap = &bob;
+                jobs[t].ops = ops;
+                jobs[t].range = 2 * times;
+                jobs[t].writePercent = writes[w];
+                jobs[t].rng = treapSeedState(t);
+                pthread_create(&ids[t], NULL, benchMixWorker, &jobs[t]);
+            }
+            for(int t = 0; t < threads; t++) pthread_join(ids[t], NULL);
+            double elapsed = nowSeconds() - start;
+            unsigned int charlie = 1;
+            testInOrder(bob.root, &charlie);
+            printf("%u/%u mix, %d thread(s): %.0f ops/sec, in order? %u, parent nulls: %u\n", 100 - writes[w], writes[w],
+                   threads, ((double)ops * threads) / elapsed, charlie, properParentTest(bob.root));
+            treapDestroy(&bob);
+            free(ids);
+            free(jobs);
+        }
+    }
+}
+
+
+// Reclamation test: readers find keys and keep reading them after the lock has
+// dropped, while a writer deletes and re-adds keys. Retiring keeps every node
+// a reader holds intact (stale reads stay zero); releasing at once, with
+// readers that let go of nodes before unlocking, is the latency baseline.
+typedef struct bench_reclaim_job {
+    treap_t *treap;
+    _Atomic int *stop;
+    int retire;
+    unsigned int range;
+    uint64_t rng;
+    unsigned long long ops, stale, deletes;
+    double worst, total;
+} bench_reclaim_job_t;
+
+static void *benchReclaimReader(void *arg){
+    bench_reclaim_job_t *job = (bench_reclaim_job_t *)arg;
+    while(!atomic_load(job->stop)){
+        unsigned int key = treapRandom(&(job->rng)) % job->range;
+        if(job->retire){
+            treapEpochEnter();
+            treap_node_t *node = treapFind(job->treap, key);
+            for(int i = 0; node != NULL && i < 64; i++){
+                if(*(volatile unsigned int *)&(node->treeKey) != key) job->stale++;
+            }
+            treapEpochExit();
+        } else {
+            treapFind(job->treap, key);
+        }
+        // Pause now and then: glibc's rwlock prefers readers, and an unbroken
+        // stream of them would starve the writer
+        if((++(job->ops) & 0xFF) == 0){
+            struct timespec nap = {0, 1000};
+            nanosleep(&nap, NULL);
+        }
+    }
+    return NULL;
+}
+
+static void *benchReclaimWriter(void *arg){
+    bench_reclaim_job_t *job = (bench_reclaim_job_t *)arg;
+    while(!atomic_load(job->stop)){
+        unsigned int key = treapRandom(&(job->rng)) % job->range;
+        double start = nowSeconds();
+        treapLockExclusive(job->treap);
+        treap_node_t *node = treapFindUnlocked(job->treap, key);
+        if(node != NULL){
+            treapDecoupleUnlocked(job->treap, node);
+            if(job->retire){
+                treapRetireUnlocked(job->treap, node);
+            } else {
+                treapRelease(job->treap, node);
+            }
+        } else {
+            treapAppendUnlocked(job->treap, key);
+        }
+        treapUnlock(job->treap);
+        if(node != NULL){
+            double took = nowSeconds() - start;
+            job->total += took;
+            if(took > job->worst) job->worst = took;
+            job->deletes++;
+        }
+        job->ops++;
+    }
+    return NULL;
+}
+
+void benchReclaim(void){
+    unsigned int range = 1 << 20, readers = 3;
+    double seconds = 1.0;
+    for(int retire = 0; retire < 2; retire++){
+        treap_t bob;
+        treapInit(&bob);
+        for(unsigned int key = 0; key < range; key += 2) treapAppend(&bob, key);
+        _Atomic int stop;
+        atomic_init(&stop, 0);
+        pthread_t ids[4];
+        bench_reclaim_job_t jobs[4];
+        for(unsigned int t = 0; t <= readers; t++){
+            jobs[t].treap = &bob;
+            jobs[t].stop = &stop;
+            jobs[t].retire = retire;
+            jobs[t].range = range;
+            jobs[t].rng = treapSeedState(t);
+            jobs[t].ops = jobs[t].stale = jobs[t].deletes = 0;
+            jobs[t].worst = jobs[t].total = 0.0;
+            pthread_create(&ids[t], NULL, (t < readers) ? benchReclaimReader : benchReclaimWriter, &jobs[t]);
+        }
+        double start = nowSeconds();
+        struct timespec nap = {0, 10000000};
+        while(nowSeconds() - start < seconds) nanosleep(&nap, NULL);
+        atomic_store(&stop, 1);
+        for(unsigned int t = 0; t <= readers; t++) pthread_join(ids[t], NULL);
+        double elapsed = nowSeconds() - start;
+
+        unsigned long long reads = 0, stale = 0;
+        for(unsigned int t = 0; t < readers; t++){
+            reads += jobs[t].ops;
+            stale += jobs[t].stale;
+        }
+        bench_reclaim_job_t *writer = &jobs[readers];
+        unsigned int charlie = 1;
+        testInOrder(bob.root, &charlie);
+        printf("%s: reads/sec %.0f, deletes/sec %.0f, delete mean %.2f us, worst %.2f us, stale reads %llu, in order? %u\n",
+               retire ? "Retire" : "Release", reads / elapsed, writer->deletes / elapsed,
+               writer->deletes ? 1e6 * writer->total / writer->deletes : 0.0, 1e6 * writer->worst, stale, charlie);
+        treapDestroy(&bob);
+    }
+}
+
+
+// Sharding benchmark: threads appending random keys into one treap against the
+// same into a streap, across thread counts; then sequential keys, which all land
+// in one shard until a rebalance
+typedef struct bench_ingest_job {
+    treap_t *treap;             // One of these two is NULL
+    streap_t *streap;
+    unsigned int ops;
+    uint64_t rng;
+} bench_ingest_job_t;
+
+static void *benchIngestWorker(void *arg){
+    bench_ingest_job_t *job = (bench_ingest_job_t *)arg;
+    for(unsigned int i = 0; i < job->ops; i++){
+        unsigned int key = treapRandom(&(job->rng));
+        if(job->streap != NULL){
+            streapAppend(job->streap, key);
+        } else {
+            treapAppend(job->treap, key);
+        }
+    }
+    return NULL;
+}
+
+// Checks that a streap iterates in strictly ascending order, returning its size,
+// or 0 if it does not
+static size_t streapCheckOrder(streap_t *streap){
+    size_t count = 0;
+    unsigned int last = 0;
+    for(streap_iter_t it = streapBegin(streap); !streapIterEnd(it); streapIterNext(&it)){
+        if(count > 0 && it.node->treeKey <= last){
+            streapIterFinish(&it);
+            return 0;
+        }
+        last = it.node->treeKey;
+        count++;
+    }
+    return count;
+}
+
+void benchSharded(void){
+    unsigned int ops = 500000, shards = 16;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int maxThreads = (cores < 4) ? 4 : (int)cores;
+    for(int threads = 1; threads <= maxThreads; threads *= 2){
+        pthread_t *ids = (pthread_t *)malloc(threads * sizeof(pthread_t));
+        bench_ingest_job_t *jobs = (bench_ingest_job_t *)malloc(threads * sizeof(bench_ingest_job_t));
+        double rates[2];
+        size_t sizes[2];
+        for(int sharded = 0; sharded < 2; sharded++){
+            treap_t bob;
+            streap_t alice;
+            treapInit(&bob);
+            streapInit(&alice, shards);
+            double start = nowSeconds();
+            for(int t = 0; t < threads; t++){
+                jobs[t].treap = sharded ? NULL : &bob;
+                jobs[t].streap = sharded ? &alice : NULL;
+                jobs[t].ops = ops;
+                jobs[t].rng = treapSeedState(t);
+                pthread_create(&ids[t], NULL, benchIngestWorker, &jobs[t]);
+            }
+            for(int t = 0; t < threads; t++) pthread_join(ids[t], NULL);
+            rates[sharded] = ((double)ops * threads) / (nowSeconds() - start);
+            sizes[sharded] = sharded ? streapCheckOrder(&alice) : countNodes(bob.root);
+            treapDestroy(&bob);
+            streapDestroy(&alice);
+        }
+        printf("%d thread(s): one treap %.0f appends/sec, %u shards %.0f appends/sec, sizes agree? %d\n",
+               threads, rates[0], shards, rates[1], sizes[0] == sizes[1]);
+        free(ids);
+        free(jobs);
+    }
+
+    streap_t alice;
+    streapInit(&alice, 8);
+    for(unsigned int key = 0; key < 1000000; key++) streapAppend(&alice, key);
+    for(int pass = 0; pass < 2; pass++){
+        printf("%s rebalance, shard sizes:", pass ? "After" : "Before");
+        for(unsigned int i = 0; i < alice.count; i++) printf(" %u", countNodes(alice.shards[i].treap.root));
+        printf(", in order? %d\n", streapCheckOrder(&alice) == 1000000);
+        if(pass == 0){
+            double start = nowSeconds();
+            streapRebalance(&alice);
+            printf("Rebalanced in %f seconds\n", nowSeconds() - start);
+        }
+    }
+    streapDestroy(&alice);
+}
+#endif
+
+
+// Checks a ctreap snapshot for order and heap order, returning its size, or
+// -1 on a violation
+static long checkCtreap(const ctreap_node_t *node, long lo, long hi, unsigned int ceiling){
+    if(node == NULL) return 0;
+    if((long)node->treeKey < lo || (long)node->treeKey > hi || node->heapKey > ceiling) return -1;
+    long l = checkCtreap(node->L, lo, (long)node->treeKey - 1, node->heapKey);
+    long r = checkCtreap(node->R, (long)node->treeKey + 1, hi, node->heapKey);
+    return (l < 0 || r < 0) ? -1 : l + r + 1;
+}
+
+// Concurrent stress test: readers look up keys that are always present and
+// validate whole snapshots while writers churn disjoint sets of other keys
+typedef struct bench_ctreap_job {
+    ctreap_t *treap;
+    _Atomic int *stop;
+    unsigned int id, writers, range;
+    unsigned char *present;         // Writer: which of its keys it left in
+    unsigned long long ops, failures, snapshots;
+} bench_ctreap_job_t;
+
+static void *benchCtreapReader(void *arg){
+    bench_ctreap_job_t *job = (bench_ctreap_job_t *)arg;
+    uint64_t rng = treapSeedState(job->id);
+    while(!atomic_load(job->stop)){
+        // Multiples of 4 are inserted up front and never touched again
+        unsigned int key = 4 * (treapRandom(&rng) % (job->range / 4));
+        if(!ctreapFind(job->treap, key)) job->failures++;
+        job->ops++;
+        if((job->ops & 0xFFFF) == 0){
+            if(checkCtreap(ctreapReadBegin(job->treap), -1, (long)job->range, UINT32_MAX) < 0) job->failures++;
+            ctreapReadEnd(job->treap);
+            job->snapshots++;
+        }
+    }
+    return NULL;
+}
+
+static void *benchCtreapWriter(void *arg){
+    bench_ctreap_job_t *job = (bench_ctreap_job_t *)arg;
+    uint64_t rng = treapSeedState(1000 + job->id);
+    while(!atomic_load(job->stop)){
+        // Writer w owns the odd keys congruent to w modulo the writer count
+        unsigned int slot = treapRandom(&rng) % (job->range / (2 * job->writers));
+        unsigned int key = 2 * (slot * job->writers + job->id) + 1;
+        if(job->present[slot]){
+            if(!ctreapErase(job->treap, key)) job->failures++;
+        } else {
+            if(!ctreapInsert(job->treap, key)) job->failures++;
+        }
+        job->present[slot] ^= 1;
+        job->ops++;
+    }
+    return NULL;
+}
+
+void benchConcurrent(void){
+    unsigned int range = 1 << 20, readers = 4, writers = 2;
+    double seconds = 2.0;
+    ctreap_t bob;
+    ctreapInit(&bob);
+    for(unsigned int key = 0; key < range; key += 4) ctreapInsert(&bob, key);
+
+    _Atomic int stop;
+    atomic_init(&stop, 0);
+    pthread_t ids[6];
+    bench_ctreap_job_t jobs[6];
+    for(unsigned int t = 0; t < readers + writers; t++){
+        jobs[t].treap = &bob;
+        jobs[t].stop = &stop;
+        jobs[t].id = (t < readers) ? t : t - readers;
+        jobs[t].writers = writers;
+        jobs[t].range = range;
+        jobs[t].present = (t < readers) ? NULL : (unsigned char *)calloc(range / (2 * writers), 1);
+        jobs[t].ops = jobs[t].failures = jobs[t].snapshots = 0;
+        pthread_create(&ids[t], NULL, (t < readers) ? benchCtreapReader : benchCtreapWriter, &jobs[t]);
+    }
+    double start = nowSeconds();
+    struct timespec nap = {0, 10000000};
+    while(nowSeconds() - start < seconds) nanosleep(&nap, NULL);
+    atomic_store(&stop, 1);
+    for(unsigned int t = 0; t < readers + writers; t++) pthread_join(ids[t], NULL);
+    double elapsed = nowSeconds() - start;
+
+    unsigned long long reads = 0, writes = 0, failures = 0, snapshots = 0;
+    for(unsigned int t = 0; t < readers + writers; t++){
+        if(t < readers) reads += jobs[t].ops; else writes += jobs[t].ops;
+        failures += jobs[t].failures;
+        snapshots += jobs[t].snapshots;
+    }
+
+    // Final contents must match what the writers recorded
+    unsigned int wrong = 0;
+    for(unsigned int t = readers; t < readers + writers; t++){
+        for(unsigned int slot = 0; slot < range / (2 * writers); slot++){
+            unsigned int key = 2 * (slot * writers + jobs[t].id) + 1;
+            if(ctreapFind(&bob, key) != jobs[t].present[slot]) wrong++;
+        }
+        free(jobs[t].present);
+    }
+    long size = checkCtreap(atomic_load(&(bob.root)), -1, (long)range, UINT32_MAX);
+    printf("Reads/sec: %.0f, writes/sec: %.0f, snapshots checked: %llu\n", reads / elapsed, writes / elapsed, snapshots);
+    size_t pending = 0;
+    for(int b = 0; b < 3; b++) pending += bob.limbo[b].count;
+    printf("Failures: %llu, wrong keys at end: %u, final size: %ld, retired pending: %zu\n", failures, wrong, size, pending);
+    ctreapDestroy(&bob);
+}
+
+
+// Persistent test: a reader thread keeps re-checking one version while the
+// writer goes on making new ones from the same family; afterwards every saved
+// version must still hold what it did when saved
+static unsigned long long ptreapKeySum(const ptreap_node_t *node){
+    if(node == NULL) return 0;
+    return node->treeKey + ptreapKeySum(node->L) + ptreapKeySum(node->R);
+}
+
+typedef struct bench_snapshot_job {
+    ptreap_node_t *version;
+    long size;
+    unsigned long long sum, scans, failures;
+    _Atomic int *stop;
+} bench_snapshot_job_t;
+
+static void *benchSnapshotReader(void *arg){
+    bench_snapshot_job_t *job = (bench_snapshot_job_t *)arg;
+    while(!atomic_load(job->stop)){
+        if(checkCtreap(job->version, -1, (long)UINT32_MAX, UINT32_MAX) != job->size) job->failures++;
+        if(ptreapKeySum(job->version) != job->sum) job->failures++;
+        job->scans++;
+    }
+    return NULL;
+}
+
+void benchPersistent(void){
+    unsigned int times = 1000000, rounds = 10, range = 4 * times;
+    ptreap_t family;
+    ptreapInit(&family);
+    ptreap_node_t *versions[11];
+    long sizes[11];
+    unsigned long long sums[11];
+
+    // Plain building speed against treapAppend
+    uint64_t rng = treapSeedState(1);
+    ptreap_node_t *version = NULL;
+    long size = 0;
+    unsigned long long sum = 0;
+    double start = nowSeconds();
+    for(unsigned int i = 0; i < times; i++){
+        unsigned int key = treapRandom(&rng) % range;
+        ptreap_node_t *next = ptreapInsert(&family, version, key);
+        if(next != version){
+            size++;
+            sum += key;
+        }
+        version = next;
+    }
+    double persistent = nowSeconds() - start;
+    treap_t bob;
+    treapInit(&bob);
+    rng = treapSeedState(1);
+    start = nowSeconds();
+    for(unsigned int i = 0; i < times; i++) treapAppend(&bob, treapRandom(&rng) % range);
+    double plain = nowSeconds() - start;
+    treapDestroy(&bob);
+    printf("%u inserts: persistent %f s, treapAppend %f s\n", times, persistent, plain);
+
+    // Random inserts and erases, saving a version after each round
+    versions[0] = version;
+    sizes[0] = size;
+    sums[0] = sum;
+    _Atomic int stop;
+    atomic_init(&stop, 0);
+    bench_snapshot_job_t job = {versions[0], sizes[0], sums[0], 0, 0, &stop};
+    pthread_t reader;
+    pthread_create(&reader, NULL, benchSnapshotReader, &job);
+    start = nowSeconds();
+    for(unsigned int r = 1; r <= rounds; r++){
+        for(unsigned int i = 0; i < times / rounds; i++){
+            unsigned int key = treapRandom(&rng) % range;
+            ptreap_node_t *next;
+            if(treapRandom(&rng) & 1){
+                next = ptreapInsert(&family, version, key);
+                if(next != version){
+                    size++;
+                    sum += key;
+                }
+            } else {
+                next = ptreapErase(&family, version, key);
+                if(next != version){
+                    size--;
+                    sum -= key;
+                }
+            }
+            version = next;
+        }
+        versions[r] = version;
+        sizes[r] = size;
+        sums[r] = sum;
+    }
+    double writing = nowSeconds() - start;
+    atomic_store(&stop, 1);
+    pthread_join(reader, NULL);
+
+    unsigned int intact = 0;
+    for(unsigned int r = 0; r <= rounds; r++){
+        if(checkCtreap(versions[r], -1, (long)UINT32_MAX, UINT32_MAX) == sizes[r] && ptreapKeySum(versions[r]) == sums[r]) intact++;
+    }
+    size_t nodes = 0;
+    for(ptreap_slab_t *slab = family.slabs; slab != NULL; slab = slab->next) nodes += slab->count;
+    printf("Writes/sec alongside a reader: %.0f, snapshot scans: %llu, scan failures: %llu\n", times / writing, job.scans, job.failures);
+    printf("Versions intact: %u of %u, nodes held by all versions: %zu (latest has %ld)\n", intact, rounds + 1, nodes, size);
+    ptreapDestroy(&family);
+}
+
+
+// Clone test: what-if forks of a large version, each cloned in O(1), changed a
+// little and released, against deep-copying the version for every fork
+static size_t ptreapLiveNodes(ptreap_t *family){
+    size_t nodes = 0;
+    for(ptreap_slab_t *slab = family->slabs; slab != NULL; slab = slab->next) nodes += slab->count;
+    if(family->slabs != NULL) nodes -= family->slabs->count - family->used;
+    for(ptreap_node_t *node = family->freeList; node != NULL; node = node->L) nodes--;
+    return nodes;
+}
+
+static ptreap_node_t *ptreapDeepCopy(ptreap_t *family, const ptreap_node_t *node){
+    if(node == NULL) return NULL;
+    ptreap_node_t *copy = ptreapNodeAlloc(family);
+    *copy = *node;
+    copy->refs = 1;
+    copy->L = ptreapDeepCopy(family, node->L);
+    copy->R = ptreapDeepCopy(family, node->R);
+    return copy;
+}
+
+void benchClone(void){
+    unsigned int times = 1000000, range = 4 * times, forks = 10000, copies = 20, edits = 16;
+    ptreap_t family;
+    ptreapInitCounted(&family);
+    uint64_t rng = treapSeedState(1);
+    ptreap_node_t *base = NULL;
+    for(unsigned int i = 0; i < times; i++) base = ptreapInsert(&family, base, treapRandom(&rng) % range);
+    long size = checkCtreap(base, -1, (long)UINT32_MAX, UINT32_MAX);
+    unsigned long long sum = ptreapKeySum(base);
+    size_t live = ptreapLiveNodes(&family), extra = 0;
+
+    // Each fork checks its own edits as it goes
+    unsigned long long failures = 0;
+    double start = nowSeconds();
+    for(unsigned int f = 0; f < forks; f++){
+        ptreap_node_t *fork = ptreapClone(&family, base);
+        for(unsigned int e = 0; e < edits; e++){
+            unsigned int key = treapRandom(&rng) % range;
+            if(e & 1){
+                fork = ptreapErase(&family, fork, key);
+                if(ptreapFind(fork, key) != NULL) failures++;
+            } else {
+                fork = ptreapInsert(&family, fork, key);
+                if(ptreapFind(fork, key) == NULL) failures++;
+            }
+        }
+        if((f & 0xFF) == 0) extra += ptreapLiveNodes(&family) - live;
+        ptreapRelease(&family, fork);
+    }
+    double cloning = (nowSeconds() - start) / forks;
+
+    start = nowSeconds();
+    for(unsigned int f = 0; f < copies; f++){
+        ptreap_node_t *fork = ptreapDeepCopy(&family, base);
+        for(unsigned int e = 0; e < edits; e++){
+            unsigned int key = treapRandom(&rng) % range;
+            fork = (e & 1) ? ptreapErase(&family, fork, key) : ptreapInsert(&family, fork, key);
+        }
+        ptreapRelease(&family, fork);
+    }
+    double copying = (nowSeconds() - start) / copies;
+
+    int intact = checkCtreap(base, -1, (long)UINT32_MAX, UINT32_MAX) == size && ptreapKeySum(base) == sum;
+    printf("Fork of %ld keys with %u edits: clone %.2f us, deep copy %.2f us\n", size, edits, 1e6 * cloning, 1e6 * copying);
+    printf("Nodes copied per cloned fork: %.1f, failures: %llu, base intact? %d, leaked nodes: %zd\n",
+           (double)extra / ((forks + 0xFF) / 0x100), failures, intact, (ssize_t)(ptreapLiveNodes(&family) - live));
+    ptreapRelease(&family, base);
+    printf("Live nodes after releasing the base: %zu\n", ptreapLiveNodes(&family));
+    ptreapDestroy(&family);
+}
+
 
+// Erase test: deleting every key of a treap, in random order, by find then
+// decouple against treapEraseKey's single descent; then half the keys with
+// their nodes handed back and appended again
+void benchErase(void){
+    unsigned int times = 1000000;
+    unsigned int *keys = (unsigned int *)malloc(times * sizeof(unsigned int));
+    for(unsigned int i = 0; i < times; i++) keys[i] = i;
+    uint64_t rng = treapSeedState(1);
+    for(unsigned int i = times - 1; i > 0; i--){
+        unsigned int j = treapRandom(&rng) % (i + 1), swap = keys[i];
+        keys[i] = keys[j];
+        keys[j] = swap;
+    }
+
+    double t[2];
+    for(int single = 0; single < 2; single++){
+        treap_t bob;
+        treapInit(&bob);
+        for(unsigned int i = 0; i < times; i++) treapAppend(&bob, i);
+        double start = nowSeconds();
+        for(unsigned int i = 0; i < times; i++){
+            if(single){
+                treapEraseKey(&bob, keys[i], NULL);
+            } else {
+                treap_node_t *bill = treapFind(&bob, keys[i]);
+                treapDecouple(&bob, bill);
+                treapRelease(&bob, bill);
+            }
+        }
+        t[single] = nowSeconds() - start;
+        if(bob.root != NULL) printf("Treap not empty!\n");
+        treapDestroy(&bob);
+    }
+    printf("Erase %u keys: find and decouple %f s, treapEraseKey %f s\n", times, t[0], t[1]);
+
+    treap_t bob;
+    treapInit(&bob);
+    for(unsigned int i = 0; i < times; i++) treapAppend(&bob, i);
+    unsigned int handed = 0;
+    for(unsigned int i = 0; i < times / 2; i++){
+        treap_node_t *bill;
+        if(treapEraseKey(&bob, keys[i], &bill)){
+            if(bill != NULL && bill->treeKey == keys[i]) handed++;
+            treapRelease(&bob, bill);
+        }
+    }
+    unsigned int absent = !treapEraseKey(&bob, keys[0], NULL);
     unsigned int charlie = 1;
     testInOrder(bob.root, &charlie);
-    printf("In-order?: %u\n", charlie);
+    printf("Handed back %u, absent key reported? %u, in order? %u, parent nulls: %u, size %u\n",
+           handed, absent, charlie, properParentTest(bob.root), countNodes(bob.root));
+    treapDestroy(&bob);
+    free(keys);
+}
 
-    int maxDepth = getMaxHeight(bob.root);
-    printf("Max Depth: %d\n", maxDepth);
-    double logarithm = log2(times);
-    double factor = ((double)maxDepth) / logarithm;
-    printf("Log Factor: %f\n", factor);
 
-    for(unsigned int i=times/4; i < (3 * times)/4; i++){
-        treap_node_t * bill = treapFind(&bob, i);
-        if( bill != NULL){
-            treapDecouple(&bob, bill);
-            free(bill);
-            //printf("Parent Nulls: %u\n", properParentTest(bob.root));
+// Layout test: random inserts, finds, in-order iteration and erases, to be run
+// once as built and once with TREAP_NO_PARENT (top-down insert and erase, and a
+// stack-based iterator) to compare the two node layouts.
+void benchLayout(void){
+    unsigned int times = 1000000;
+    unsigned int *keys = (unsigned int *)malloc(times * sizeof(unsigned int));
+    uint64_t rng = treapSeedState(1);
+    for(unsigned int i = 0; i < times; i++) keys[i] = treapRandom(&rng);
+
+#ifdef TREAP_NO_PARENT
+    printf("Layout without parent pointers: %zu-byte nodes\n", sizeof(treap_node_t));
+#else
+    printf("Layout with parent pointers: %zu-byte nodes\n", sizeof(treap_node_t));
+#endif
+    treap_t bob;
+    treapInit(&bob);
+    double start = nowSeconds();
+    for(unsigned int i = 0; i < times; i++) treapInsert(&bob, keys[i], NULL);
+    double insert = nowSeconds() - start;
+
+    start = nowSeconds();
+    unsigned int found = 0;
+    for(int round = 0; round < 4; round++){
+        for(unsigned int i = 0; i < times; i++) found += treapFind(&bob, keys[i]) != NULL;
+    }
+    double find = nowSeconds() - start;
+
+    start = nowSeconds();
+    unsigned long long sum = 0;
+    unsigned int count = 0;
+    for(treap_iter_t it = treapBegin(&bob); !treapIterEnd(it); treapIterNext(&it)){
+        sum += it.node->treeKey;
+        count++;
+    }
+    double iterate = nowSeconds() - start;
+    unsigned int charlie = 1;
+    testInOrder(bob.root, &charlie);
+    int height = getMaxHeight(bob.root);
+
+    start = nowSeconds();
+    for(unsigned int i = 0; i < times; i++) treapErase(&bob, keys[i]);
+    double erase = nowSeconds() - start;
+    printf("Insert %f s, find (x4) %f s, iterate %f s, erase %f s\n", insert, find, iterate, erase);
+    printf("Found %u of %u, iterated %u (sum %llu), in order? %u, max depth %d, empty after? %d\n",
+           found, 4 * times, count, sum, charlie, height, bob.root == NULL);
+    treapDestroy(&bob);
+    free(keys);
+}
+
+
+// Cache misses as counted by the hardware, via perf_event_open; -1 where the
+// kernel does not allow it (see /proc/sys/kernel/perf_event_paranoid), in
+// which case the benchmarks fall back to counting the cache lines a lookup
+// touches, i.e. its misses from a cold cache.
+static int benchMissCounterOpen(void){
+#ifdef __linux__
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+static void benchMissCounterStart(int fd){
+#ifdef __linux__
+    if(fd < 0) return;
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+#else
+    (void)fd;
+#endif
+}
+
+static long long benchMissCounterStop(int fd){
+    long long misses = -1;
+#ifdef __linux__
+    if(fd < 0) return -1;
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if(read(fd, &misses, sizeof(misses)) != sizeof(misses)) misses = -1;
+#else
+    (void)fd;
+#endif
+    return misses;
+}
+
+// Adds the 64-byte line holding p to a lookup's set of lines, if it is new
+static void benchLineTouch(uintptr_t *lines, unsigned int *count, const void *p){
+    uintptr_t line = (uintptr_t)p / 64;
+    for(unsigned int i = 0; i < *count; i++) if(lines[i] == line) return;
+    if(*count < 128) lines[(*count)++] = line;
+}
+
+// Lines treapFind touches looking for key
+static unsigned int benchLinesTreap(treap_t *treap, unsigned int key){
+    uintptr_t lines[128];
+    unsigned int count = 0;
+    for(treap_node_t *cur = treap->root; cur != NULL; cur = (key < cur->treeKey) ? cur->L : cur->R){
+        benchLineTouch(lines, &count, &(cur->treeKey));
+        benchLineTouch(lines, &count, &(cur->R));
+        if(cur->treeKey == key) break;
+    }
+    return count;
+}
+
+// Lines treapFrozenLowerBound touches looking for key
+static unsigned int benchLinesFrozen(const treap_frozen_t *frozen, unsigned int key){
+    uintptr_t lines[128];
+    unsigned int count = 0;
+    treap_frozen_iter_t it = treapFrozenLowerBound(frozen, key);
+    for(int depth = 0; depth < frozen->height; depth++) benchLineTouch(lines, &count, &(frozen->keys[it.path[depth]]));
+    return count;
+}
+
+
+// Frozen snapshot test: lookups and range scans against a van Emde Boas
+// snapshot of the same treap, with cache misses per lookup, then a thaw back.
+// Keys are the even numbers below 2n, so half the lookups miss. 100M keys
+// would need about 5 GB; the sizes stop at 16M to stay well inside that.
+void benchFrozen(void){
+    const unsigned int sizes[] = {1u << 20, 1u << 22, 1u << 24};
+    unsigned int lookups = 1000000, scans = 10000, width = 100;
+    int counter = benchMissCounterOpen();
+    printf("Misses per lookup: %s\n", (counter >= 0) ? "hardware cache-miss counter"
+                                                     : "no counter available, cache lines touched (cold-cache misses)");
+    for(size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++){
+        unsigned int n = sizes[s];
+        unsigned int *keys = (unsigned int *)malloc(n * sizeof(unsigned int));
+        unsigned int *queries = (unsigned int *)malloc(lookups * sizeof(unsigned int));
+        if(keys == NULL || queries == NULL){
+            printf("%u keys: out of memory\n", n);
+            free(keys);
+            free(queries);
+            break;
+        }
+        for(unsigned int i = 0; i < n; i++) keys[i] = 2 * i;
+        uint64_t rng = treapSeedState(s + 1);
+        for(unsigned int i = 0; i < lookups; i++) queries[i] = treapRandom(&rng) % (2 * n);
+        treap_t bob;
+        treapInit(&bob);
+        treapBuildSorted(&bob, keys, n);
+        treap_frozen_t frozen;
+        double start = nowSeconds();
+        treapFreeze(&bob, &frozen);
+        double freeze = nowSeconds() - start;
+
+        unsigned int treapFound = 0, frozenFound = 0;
+        double treapMisses, frozenMisses;
+        benchMissCounterStart(counter);
+        start = nowSeconds();
+        for(unsigned int i = 0; i < lookups; i++) treapFound += treapFind(&bob, queries[i]) != NULL;
+        double treapTime = nowSeconds() - start;
+        treapMisses = (double)benchMissCounterStop(counter);
+        benchMissCounterStart(counter);
+        start = nowSeconds();
+        for(unsigned int i = 0; i < lookups; i++) frozenFound += treapFrozenFind(&frozen, queries[i]) != NULL;
+        double frozenTime = nowSeconds() - start;
+        frozenMisses = (double)benchMissCounterStop(counter);
+        if(counter < 0){
+            treapMisses = frozenMisses = 0;
+            for(unsigned int i = 0; i < lookups; i++){
+                treapMisses += benchLinesTreap(&bob, queries[i]);
+                frozenMisses += benchLinesFrozen(&frozen, queries[i]);
+            }
+        }
+
+        // Range scans: width keys from a random start, checked against the
+        // arithmetic sum of the even keys they must be
+        unsigned long long scanSum = 0, expectSum = 0;
+        start = nowSeconds();
+        for(unsigned int i = 0; i < scans; i++){
+            unsigned int w = 0;
+            for(treap_frozen_iter_t it = treapFrozenLowerBound(&frozen, queries[i]);
+                w < width && !treapFrozenIterEnd(it); treapFrozenIterNext(&it), w++){
+                scanSum += frozen.keys[it.slot];
+            }
+            unsigned int first = (queries[i] + 1) / 2;
+            for(unsigned int k = first; k < first + width && k < n; k++) expectSum += 2ull * k;
+        }
+        double scanTime = nowSeconds() - start;
+
+        printf("%u keys: freeze %f s, %u lookups: treapFind %f s (%.1f misses each), frozen %f s (%.1f misses each), found %u %u\n",
+               n, freeze, lookups, treapTime, treapMisses / lookups, frozenTime, frozenMisses / lookups, treapFound, frozenFound);
+        printf("    %u scans of %u keys: %f s, sums agree? %d\n", scans, width, scanTime, scanSum == expectSum);
+
+        if(s == 0){
+            treap_t carol;
+            treapInit(&carol);
+            treapThaw(&frozen, &carol);
+            unsigned int charlie = 1, same = countNodes(carol.root) == n;
+            testInOrder(carol.root, &charlie);
+            for(unsigned int i = 0; i < lookups && same; i++){
+                same = (treapFind(&carol, queries[i]) != NULL) == (treapFind(&bob, queries[i]) != NULL);
+            }
+            printf("    Thawed: in order? %u, same keys? %u\n", charlie, same);
+            treapDestroy(&carol);
+        }
+        treapFrozenDestroy(&frozen);
+        treapDestroy(&bob);
+        free(keys);
+        free(queries);
+    }
+    if(counter >= 0) close(counter);
+}
+
+
+// Eytzinger test: treapFind against treapEytzingerFind (and the van Emde Boas
+// snapshot) on the same key set, the even numbers below 2n, so half the lookups
+// miss; then a range scan and a full in-order walk of the array.
+void benchEytzinger(void){
+    const unsigned int sizes[] = {1u << 16, 1u << 20, 1u << 24};
+    unsigned int lookups = 4000000;
+    for(size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++){
+        unsigned int n = sizes[s];
+        unsigned int *keys = (unsigned int *)malloc(n * sizeof(unsigned int));
+        unsigned int *queries = (unsigned int *)malloc(lookups * sizeof(unsigned int));
+        if(keys == NULL || queries == NULL){
+            printf("%u keys: out of memory\n", n);
+            free(keys);
+            free(queries);
+            break;
+        }
+        for(unsigned int i = 0; i < n; i++) keys[i] = 2 * i;
+        uint64_t rng = treapSeedState(s + 1);
+        for(unsigned int i = 0; i < lookups; i++) queries[i] = treapRandom(&rng) % (2 * n);
+        treap_t bob;
+        treapInit(&bob);
+        treapBuildSorted(&bob, keys, n);
+        treap_eytzinger_t ey;
+        double start = nowSeconds();
+        treapEytzingerBuild(&bob, &ey);
+        double build = nowSeconds() - start;
+        treap_frozen_t frozen;
+        treapFreeze(&bob, &frozen);
+
+        unsigned int found[3] = {0, 0, 0};
+        double t[3];
+        start = nowSeconds();
+        for(unsigned int i = 0; i < lookups; i++) found[0] += treapFind(&bob, queries[i]) != NULL;
+        t[0] = nowSeconds() - start;
+        start = nowSeconds();
+        for(unsigned int i = 0; i < lookups; i++) found[1] += treapFrozenFind(&frozen, queries[i]) != NULL;
+        t[1] = nowSeconds() - start;
+        start = nowSeconds();
+        for(unsigned int i = 0; i < lookups; i++) found[2] += treapEytzingerFind(&ey, queries[i]) != NULL;
+        t[2] = nowSeconds() - start;
+
+        unsigned int ordered = 1, walked = 0, bounds = 1;
+        unsigned int prev = 0;
+        for(size_t k = treapEytzingerBegin(&ey); k != 0; k = treapEytzingerNext(&ey, k), walked++){
+            if(walked > 0 && ey.keys[k] <= prev) ordered = 0;
+            prev = ey.keys[k];
+        }
+        for(unsigned int i = 0; i < 1000; i++){
+            size_t k = treapEytzingerLowerBound(&ey, queries[i]);
+            treap_node_t *lb = treapLowerBound(&bob, queries[i]);
+            if((k == 0) != (lb == NULL) || (lb != NULL && ey.keys[k] != lb->treeKey)) bounds = 0;
+        }
+        printf("%u keys: build %f s, %u lookups: treapFind %f s, van Emde Boas %f s, Eytzinger %f s, found %u %u %u\n",
+               n, build, lookups, t[0], t[1], t[2], found[0], found[1], found[2]);
+        printf("    In-order walk: %u keys, ascending? %u, lower bounds agree? %u\n", walked, ordered, bounds);
+        treapEytzingerDestroy(&ey);
+        treapFrozenDestroy(&frozen);
+        treapDestroy(&bob);
+        free(keys);
+        free(queries);
+    }
+}
+
+
+// Walks a btreap in order with an explicit stack, checking that keys ascend
+// across and within blocks and that priorities respect the heap order.
+// Returns the number of keys (0 with a message if anything is wrong); the
+// block count and depth in blocks go to *blocks and *height.
+static size_t btreapCheck(btreap_t *treap, size_t *blocks, int *height){
+    btreap_node_t **stack = NULL;
+    int *depths = NULL;
+    size_t depth = 0, capacity = 0, keys = 0;
+    int ok = 1, started = 0;
+    unsigned int last = 0;
+    *blocks = 0;
+    *height = 0;
+    btreap_node_t *cur = treap->root;
+    int curDepth = 1;
+    while(cur != NULL || depth > 0){
+        while(cur != NULL){
+            if(depth == capacity){
+                capacity = (capacity == 0) ? 64 : capacity * 2;
+                stack = (btreap_node_t **)realloc(stack, capacity * sizeof(btreap_node_t *));
+                depths = (int *)realloc(depths, capacity * sizeof(int));
+                if(stack == NULL || depths == NULL){
+                    fprintf(stderr, "btreap: out of memory\n");
+                    exit(1);
+                }
+            }
+            if(cur->L != NULL && cur->L->heapKey > cur->heapKey) ok = 0;
+            if(cur->R != NULL && cur->R->heapKey > cur->heapKey) ok = 0;
+            if(curDepth > *height) *height = curDepth;
+            stack[depth] = cur;
+            depths[depth++] = curDepth++;
+            cur = cur->L;
+        }
+        cur = stack[--depth];
+        curDepth = depths[depth] + 1;
+        if(cur->count == 0 || cur->count > BTREAP_BLOCK) ok = 0;
+        for(unsigned int i = 0; i < cur->count; i++){
+            if(started && cur->keys[i] <= last) ok = 0;
+            last = cur->keys[i];
+            started = 1;
+        }
+        keys += cur->count;
+        (*blocks)++;
+        cur = cur->R;
+    }
+    free(stack);
+    free(depths);
+    if(!ok || keys != treap->count){
+        printf("btreap: broken (%zu keys walked, %zu counted)\n", keys, treap->count);
+        return 0;
+    }
+    return keys;
+}
+
+// Lines btreapFind touches looking for key
+static unsigned int benchLinesBlock(btreap_t *treap, unsigned int key){
+    uintptr_t lines[128];
+    unsigned int count = 0;
+    for(btreap_node_t *cur = treap->root; cur != NULL; ){
+        benchLineTouch(lines, &count, cur);
+        if(key < cur->keys[0]){
+            cur = cur->L;
+        } else if(key > cur->keys[cur->count - 1]){
+            cur = cur->R;
         } else {
-            printf("Not found!\n");
-            exit(2);
+            break;
+        }
+    }
+    return count;
+}
+
+// Block test: random inserts, finds and erases on a btreap against the core
+// treap, with the cache lines a lookup touches (its misses from a cold cache)
+// and the shape of the tree of blocks.
+void benchBlock(void){
+#if BTREAP_BLOCK == 8 && defined(__AVX2__)
+    printf("Block search: AVX2, %d keys per block\n", BTREAP_BLOCK);
+#elif BTREAP_BLOCK == 8 && defined(__SSE2__)
+    printf("Block search: SSE2, %d keys per block\n", BTREAP_BLOCK);
+#else
+    printf("Block search: scalar, %d keys per block\n", BTREAP_BLOCK);
+#endif
+    const unsigned int sizes[] = {1u << 20, 1u << 22};
+    unsigned int lookups = 1000000;
+    for(size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++){
+        unsigned int n = sizes[s];
+        unsigned int *keys = (unsigned int *)malloc(n * sizeof(unsigned int));
+        unsigned int *queries = (unsigned int *)malloc(lookups * sizeof(unsigned int));
+        uint64_t rng = treapSeedState(s + 1);
+        for(unsigned int i = 0; i < n; i++) keys[i] = treapRandom(&rng);
+        for(unsigned int i = 0; i < lookups; i++) queries[i] = (i & 1) ? keys[treapRandom(&rng) % n] : treapRandom(&rng);
+
+        treap_t bob;
+        btreap_t bill;
+        treapInit(&bob);
+        btreapInit(&bill);
+        double start = nowSeconds();
+        for(unsigned int i = 0; i < n; i++) treapInsert(&bob, keys[i], NULL);
+        double treapInsertTime = nowSeconds() - start;
+        start = nowSeconds();
+        for(unsigned int i = 0; i < n; i++) btreapInsert(&bill, keys[i]);
+        double blockInsertTime = nowSeconds() - start;
+
+        unsigned int treapFound = 0, blockFound = 0;
+        start = nowSeconds();
+        for(unsigned int i = 0; i < lookups; i++) treapFound += treapFind(&bob, queries[i]) != NULL;
+        double treapFindTime = nowSeconds() - start;
+        start = nowSeconds();
+        for(unsigned int i = 0; i < lookups; i++) blockFound += btreapFind(&bill, queries[i]) != NULL;
+        double blockFindTime = nowSeconds() - start;
+        double treapLines = 0, blockLines = 0;
+        for(unsigned int i = 0; i < lookups; i++){
+            treapLines += benchLinesTreap(&bob, queries[i]);
+            blockLines += benchLinesBlock(&bill, queries[i]);
+        }
+
+        size_t blocks;
+        int height;
+        size_t held = btreapCheck(&bill, &blocks, &height);
+        printf("%u keys: insert treap %f s, btreap %f s; %u finds treap %f s, btreap %f s, found %u %u\n",
+               n, treapInsertTime, blockInsertTime, lookups, treapFindTime, blockFindTime, treapFound, blockFound);
+        printf("    Lines per find: treap %.1f, btreap %.1f; max depth treap %d, btreap %d blocks (%zu blocks, %.1f keys each)\n",
+               treapLines / lookups, blockLines / lookups, getMaxHeight(bob.root) + 1, height, blocks, (double)held / blocks);
+
+        start = nowSeconds();
+        for(unsigned int i = 0; i < n; i += 2) treapErase(&bob, keys[i]);
+        double treapEraseTime = nowSeconds() - start;
+        start = nowSeconds();
+        for(unsigned int i = 0; i < n; i += 2) btreapErase(&bill, keys[i]);
+        double blockEraseTime = nowSeconds() - start;
+        unsigned int agree = 1;
+        for(unsigned int i = 0; i < lookups; i++){
+            if((treapFind(&bob, queries[i]) != NULL) != (btreapFind(&bill, queries[i]) != NULL)) agree = 0;
         }
+        held = btreapCheck(&bill, &blocks, &height);
+        printf("    Erase half: treap %f s, btreap %f s; agree? %u, %zu keys in %zu blocks (%.1f each), max depth %d\n",
+               treapEraseTime, blockEraseTime, agree, held, blocks, (double)held / blocks, height);
+        treapDestroy(&bob);
+        btreapDestroy(&bill);
+        free(keys);
+        free(queries);
     }
+}
 
-    charlie = 1;
-    testInOrder(bob.root, &charlie);
-    printf("Post-deletions: In order? %d\n", charlie);
 
-    printf("Max Depth: %d\n", getMaxHeight(bob.root));
-    return factor;
+// Bulk lookup test: a batch of independent random lookups (half of them
+// misses) resolved by back-to-back treapFind calls and by treapFindMany, whose
+// answers must match.
+void benchFindMany(void){
+    const unsigned int sizes[] = {1u << 16, 1u << 20, 1u << 24};
+    unsigned int lookups = 4000000;
+    unsigned int *queries = (unsigned int *)malloc(lookups * sizeof(unsigned int));
+    treap_node_t **single = (treap_node_t **)malloc(lookups * sizeof(treap_node_t *));
+    treap_node_t **many = (treap_node_t **)malloc(lookups * sizeof(treap_node_t *));
+    for(size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++){
+        unsigned int n = sizes[s];
+        unsigned int *keys = (unsigned int *)malloc(n * sizeof(unsigned int));
+        for(unsigned int i = 0; i < n; i++) keys[i] = 2 * i;
+        uint64_t rng = treapSeedState(s + 1);
+        for(unsigned int i = 0; i < lookups; i++) queries[i] = treapRandom(&rng) % (2 * n);
+        treap_t bob;
+        treapInit(&bob);
+        treapBuildSorted(&bob, keys, n);
+
+        double start = nowSeconds();
+        for(unsigned int i = 0; i < lookups; i++) single[i] = treapFind(&bob, queries[i]);
+        double one = nowSeconds() - start;
+        start = nowSeconds();
+        treapFindMany(&bob, queries, lookups, many);
+        double group = nowSeconds() - start;
+
+        unsigned int agree = memcmp(single, many, lookups * sizeof(treap_node_t *)) == 0, found = 0;
+        for(unsigned int i = 0; i < lookups; i++) found += many[i] != NULL;
+        printf("%u keys, %u lookups: treapFind %f s, treapFindMany %f s (%.2fx), agree? %u, found %u\n",
+               n, lookups, one, group, one / group, agree, found);
+        treapDestroy(&bob);
+        free(keys);
+    }
+    free(queries);
+    free(single);
+    free(many);
 }
 
-// Second test: assesses locality prioritization
-void testTwo(void){
-    treap_t bob;
-    bob.root = NULL;
 
-    for(unsigned int i = 0; i < 10; i++){
-        treapAppend(&bob, i);
+// Dictionary test: counting the distinct keys of a stream with repeats, by
+// find-then-append against one treapInsert per key, then erasing by key. With
+// TREAP_VALUE_TYPE, each key's value must be that of its first occurrence.
+void benchDict(void){
+    unsigned int times = 2000000, range = 1 << 20;
+    unsigned int *keys = (unsigned int *)malloc(times * sizeof(unsigned int));
+    uint64_t rng = treapSeedState(1);
+    for(unsigned int i = 0; i < times; i++) keys[i] = treapRandom(&rng) % range;
+
+    treap_t bob, alice;
+    treapInit(&bob);
+    treapInit(&alice);
+    unsigned int distinct = 0, inserts = 0;
+    double start = nowSeconds();
+    for(unsigned int i = 0; i < times; i++){
+        if(treapFind(&bob, keys[i]) == NULL){
+            treapAppend(&bob, keys[i]);
+            distinct++;
+        }
     }
-    printTreap(&bob);
+    double twice = nowSeconds() - start;
+    start = nowSeconds();
+    for(unsigned int i = 0; i < times; i++){
+        int inserted;
+        treapInsert(&alice, keys[i], &inserted);
+        inserts += inserted;
+    }
+    double once = nowSeconds() - start;
+    printf("Distinct keys: find-then-append %f s (%u), treapInsert %f s (%u)\n", twice, distinct, once, inserts);
 
-    for(int i = 0; i < 20; i++){
-        treapUsurpingFind(&bob, 1);
-        treapUsurpingFind(&bob, 8);
+#ifdef TREAP_VALUE_TYPE
+    treap_t carol;
+    treapInit(&carol);
+    unsigned int *first = (unsigned int *)malloc(range * sizeof(unsigned int));
+    memset(first, 0xFF, range * sizeof(unsigned int));
+    for(unsigned int i = 0; i < times; i++){
+        treapGetOrInsert(&carol, keys[i], (TREAP_VALUE_TYPE)(uintptr_t)i);
+        if(first[keys[i]] == UINT32_MAX) first[keys[i]] = i;
     }
+    unsigned int wrong = 0;
+    for(treap_iter_t it = treapBegin(&carol); !treapIterEnd(it); treapIterNext(&it)){
+        if((uintptr_t)it.node->value != first[it.node->treeKey]) wrong++;
+    }
+    printf("treapGetOrInsert: values wrong %u of %u\n", wrong, countNodes(carol.root));
+    treapDestroy(&carol);
+    free(first);
+#endif
 
-    printTreap(&bob);
-    
+    unsigned int erased = 0;
+    start = nowSeconds();
+    for(unsigned int i = 0; i < times; i++) erased += treapErase(&alice, keys[i]);
+    printf("treapErase: %f s, erased %u, left %u\n", nowSeconds() - start, erased, countNodes(alice.root));
+    treapDestroy(&bob);
+    treapDestroy(&alice);
+    free(keys);
+}
+
+
+// Generic treaps test: an unsigned int instantiation against the core treap on
+// the same keys, then 64-bit, double and composite keys
+TREAP_DEFINE_SET(utreap, unsigned int, TREAP_LESS)
+TREAP_DEFINE(htreap, uint64_t, uint64_t, TREAP_LESS)
+TREAP_DEFINE(dtreap, double, unsigned int, TREAP_LESS)
+
+typedef struct bench_pair {
+    uint32_t major, minor;
+} bench_pair_t;
+
+#define BENCH_PAIR_LESS(a, b) ((a).major < (b).major || ((a).major == (b).major && (a).minor < (b).minor))
+TREAP_DEFINE(pairtreap, bench_pair_t, double, BENCH_PAIR_LESS)
+
+void benchGeneric(void){
+    unsigned int times = 1000000;
+    unsigned int *keys = (unsigned int *)malloc(times * sizeof(unsigned int));
+    uint64_t rng = treapSeedState(1);
+    for(unsigned int i = 0; i < times; i++) keys[i] = treapRandom(&rng);
+
+    double t[6];
+    treap_t bob;
+    treapInit(&bob);
+    double start = nowSeconds();
+    for(unsigned int i = 0; i < times; i++) treapAppend(&bob, keys[i]);
+    t[0] = nowSeconds() - start;
+    start = nowSeconds();
+    unsigned int found = 0;
+    for(unsigned int i = 0; i < times; i++) found += treapFind(&bob, keys[i]) != NULL;
+    t[1] = nowSeconds() - start;
+    start = nowSeconds();
+    for(unsigned int i = 0; i < times; i++){
+        treap_node_t *bill = treapFind(&bob, keys[i]);
+        if(bill != NULL){
+            treapDecouple(&bob, bill);
+            treapRelease(&bob, bill);
+        }
+    }
+    t[2] = nowSeconds() - start;
+    treapDestroy(&bob);
+
+    utreap_t alice;
+    utreapInit(&alice);
+    start = nowSeconds();
+    for(unsigned int i = 0; i < times; i++) utreapInsert(&alice, keys[i], NULL);
+    t[3] = nowSeconds() - start;
+    start = nowSeconds();
+    unsigned int ufound = 0;
+    for(unsigned int i = 0; i < times; i++) ufound += utreapFind(&alice, keys[i]) != NULL;
+    t[4] = nowSeconds() - start;
+    unsigned int ordered = 1;
+    for(utreap_node_t *n = utreapFirst(&alice); n != NULL && utreapNext(n) != NULL; n = utreapNext(n)){
+        if(!(n->key < utreapNext(n)->key)) ordered = 0;
+    }
+    start = nowSeconds();
+    unsigned int erased = 0;
+    for(unsigned int i = 0; i < times; i++) erased += utreapErase(&alice, keys[i]);
+    t[5] = nowSeconds() - start;
+    printf("Core treap:      append %f s, find %f s, erase %f s (%u found)\n", t[0], t[1], t[2], found);
+    printf("Generic unsigned: insert %f s, find %f s, erase %f s (%u found, %u erased, in order? %u, empty? %d)\n",
+           t[3], t[4], t[5], ufound, erased, ordered, alice.root == NULL);
+    utreapDestroy(&alice);
+
+    // Other key types: insert, look up, check order, erase half
+    htreap_t henry;
+    dtreap_t dora;
+    pairtreap_t pat;
+    htreapInit(&henry);
+    dtreapInit(&dora);
+    pairtreapInit(&pat);
+    start = nowSeconds();
+    for(unsigned int i = 0; i < times; i++){
+        htreapInsert(&henry, ((uint64_t)keys[i] << 32) | i, NULL)->value = i;
+        dtreapInsert(&dora, sqrt((double)keys[i]), NULL)->value = i;
+        bench_pair_t pair = {keys[i] >> 16, keys[i] & 0xFFFF};
+        pairtreapInsert(&pat, pair, NULL)->value = (double)i;
+    }
+    double others = nowSeconds() - start;
+    unsigned int misses = 0;
+    for(unsigned int i = 0; i < times; i++){
+        bench_pair_t pair = {keys[i] >> 16, keys[i] & 0xFFFF};
+        misses += htreapFind(&henry, ((uint64_t)keys[i] << 32) | i) == NULL;
+        misses += dtreapFind(&dora, sqrt((double)keys[i])) == NULL;
+        misses += pairtreapFind(&pat, pair) == NULL;
+    }
+    for(htreap_node_t *n = htreapFirst(&henry); n != NULL && htreapNext(n) != NULL; n = htreapNext(n)){
+        if(!(n->key < htreapNext(n)->key)) ordered = 0;
+    }
+    for(dtreap_node_t *n = dtreapFirst(&dora); n != NULL && dtreapNext(n) != NULL; n = dtreapNext(n)){
+        if(!(n->key < dtreapNext(n)->key)) ordered = 0;
+    }
+    for(pairtreap_node_t *n = pairtreapFirst(&pat); n != NULL && pairtreapNext(n) != NULL; n = pairtreapNext(n)){
+        if(!BENCH_PAIR_LESS(n->key, pairtreapNext(n)->key)) ordered = 0;
+    }
+    for(unsigned int i = 0; i < times; i += 2){
+        bench_pair_t pair = {keys[i] >> 16, keys[i] & 0xFFFF};
+        htreapErase(&henry, ((uint64_t)keys[i] << 32) | i);
+        dtreapErase(&dora, sqrt((double)keys[i]));
+        pairtreapErase(&pat, pair);
+    }
+    dtreap_node_t *root2 = dtreapLowerBound(&dora, sqrt(2.0));
+    printf("uint64_t, double and pair keys: inserts %f s, misses %u, in order? %u, lower bound of root 2 below it? %d\n",
+           others, misses, ordered, root2 != NULL && root2->key >= sqrt(2.0));
+    htreapDestroy(&henry);
+    dtreapDestroy(&dora);
+    pairtreapDestroy(&pat);
+    free(keys);
 }
 
-int main(void){
+
+// Named benchmarks, selectable from the command line
+typedef struct treap_bench {
+    const char *name;
+    void (*run)(void);
+} treap_bench_t;
+
+static const treap_bench_t benches[] = {
+    {"alloc", benchAlloc},
+    {"index", benchIndex},
+    {"priority", benchPriority},
+    {"range", benchRange},
+    {"build", benchBuild},
+    {"setops", benchSetOps},
+    {"batch", benchBatch},
+#ifndef TREAP_NO_PARENT
+    {"navigate", benchNavigate},
+#endif
+    {"traverse", benchTraverse},
+#ifdef TREAP_THREADSAFE
+    {"locking", benchLocking},
+    {"reclaim", benchReclaim},
+    {"sharded", benchSharded},
+#endif
+    {"concurrent", benchConcurrent},
+    {"persistent", benchPersistent},
+    {"clone", benchClone},
+    {"generic", benchGeneric},
+    {"dict", benchDict},
+    {"erase", benchErase},
+    {"layout", benchLayout},
+    {"frozen", benchFrozen},
+    {"eytzinger", benchEytzinger},
+    {"block", benchBlock},
+    {"findmany", benchFindMany},
+#ifdef TREAP_SIZES
+    {"rank", benchRank},
+#endif
+#ifdef TREAP_HASHED_PRIORITY
+    {"shape", testShape},
+#endif
+};
+
+int main(int argc, char **argv){
 
     srand(time(0));
+
+    if(argc > 1){
+        for(size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++){
+            if(strcmp(argv[1], benches[i].name) == 0){
+                benches[i].run();
+                return 0;
+            }
+        }
+        fprintf(stderr, "Unknown benchmark '%s'\n", argv[1]);
+        return 2;
+    }
     
     double sum = 0.0;
     int count = 0;